@@ -29,9 +29,26 @@ extern "C" {
  * @param semver The version of the protocol required for communication
  * @param err Pointer to a stream that will have an error written if present
  * @returns A file descriptor of the connection on success, -1 on failure
+ * @remarks The load balancer address is resolved on first use and cached for
+ * the life of the process. It is CATUI_ADDRESS if defined, where a leading '@'
+ * names a Linux abstract socket, then $XDG_RUNTIME_DIR/catui/load_balancer.sock
+ * if defined, then a per-user platform default.
  */
 int CATUI_API catui_connect(const char *proto, const char *semver, FILE *err);
 
+/**
+ * Connect to a catui server with the given protocol and version, requesting
+ * that the connection carry multiplexed logical sessions
+ * @param proto The device communication protocol to connect to
+ * @param semver The version of the protocol required for communication
+ * @param err Pointer to a stream that will have an error written if present
+ * @returns A file descriptor of the connection on success, -1 on failure
+ * @remarks Fails if the server acks without agreeing to multiplex. Sessions
+ * are then opened on the connection with catui_mux_open.
+ */
+int CATUI_API catui_connect_mux(const char *proto, const char *semver,
+                                FILE *err);
+
 /**
  * Looks up the catui load balancer's file descriptor, if available
  * @param err A stream that will have an error message written if applicable
@@ -86,6 +103,27 @@ int16_t CATUI_API catui_server_ack(int fd, FILE *err);
  */
 int16_t CATUI_API catui_server_nack(int fd, const char *err_to_send, FILE *err);
 
+/**
+ * Encode an ack response agreeing to multiplex logical sessions
+ *
+ * @param buf Buffer to hold bytes
+ * @param buf_size size of allocated buffer 'buf'
+ * @param err Optional stream for error messages to be written to
+ * @returns size of message if successful, < 0 on error
+ * @remarks Only send this in response to a request with
+ * CATUI_CONNECT_MULTIPLEX set
+ */
+int16_t CATUI_API catui_server_encode_mux_ack(void *buf, size_t buf_size,
+                                              FILE *err);
+
+/**
+ * Send an ack message agreeing to multiplex logical sessions
+ * @param fd The file descriptor to write to
+ * @param err A stream that will have an error message written if applicable
+ * @returns size of message if successful, < 0 on error
+ */
+int16_t CATUI_API catui_server_ack_mux(int fd, FILE *err);
+
 #define CATUI_PROTOCOL_SIZE 128
 #define CATUI_VERSION_SIZE 23 // 5maj + 5min + 10pat + 2dots + null
 
@@ -144,6 +182,12 @@ int catui_semver_can_support(const catui_semver *api,
  */
 int catui_semver_can_use(const catui_semver *consumer, const catui_semver *api);
 
+/// Request that the connection carry multiplexed logical sessions
+#define CATUI_CONNECT_MULTIPLEX 0x1
+
+/// Request that the ack advertise the server's exact version and capabilities
+#define CATUI_CONNECT_ACK_INFO 0x2
+
 /**
  * Structure representing a catui connect request
  */
@@ -179,6 +223,677 @@ int CATUI_API catui_encode_connect(const catui_connect_request *req, void *buf,
 int CATUI_API catui_decode_connect(const void *buf, size_t msgsz,
                                    catui_connect_request *req);
 
+/**
+ * Encode a connect request with options
+ * @param[in] req The connect request to encode
+ * @param[in] flags Bitwise OR of CATUI_CONNECT_* options. 0 encodes the same
+ * request as catui_encode_connect
+ * @param[in] buf The buffer to encode the message to
+ * @param[in] bufsz The size of buf in bytes
+ * @param[out] msgsz The size of the encoded message
+ * @returns 1 on success, 0 on failure
+ */
+int CATUI_API catui_encode_connect_ex(const catui_connect_request *req,
+                                      uint32_t flags, void *buf, size_t bufsz,
+                                      size_t *msgsz);
+
+/**
+ * Decode a connect request and the options it asks for
+ * @param[in] buf The buffer containing the encoded bytes
+ * @param[in] msgsz The size of the encoded message
+ * @param[out] req The structure to hold the decoded message
+ * @param[out] flags Optional. Bitwise OR of the CATUI_CONNECT_* options
+ * requested
+ * @returns 1 on success, 0 on failure
+ */
+int CATUI_API catui_decode_connect_ex(const void *buf, size_t msgsz,
+                                      catui_connect_request *req,
+                                      uint32_t *flags);
+
+/**
+ * Structure representing what a server said in its ack
+ */
+typedef struct {
+  /// Bitwise OR of the requested CATUI_CONNECT_* options the server agreed to
+  uint32_t flags;
+
+  /// The server's exact protocol version when flags has CATUI_CONNECT_ACK_INFO
+  catui_semver version;
+
+  /// Server defined capability bitmap when flags has CATUI_CONNECT_ACK_INFO
+  uint32_t capabilities;
+} catui_ack_info;
+
+/**
+ * Decode an ack response
+ * @param[in] buf The buffer containing the encoded bytes
+ * @param[in] msgsz The size of the encoded message
+ * @param[out] info The structure to hold what the server said
+ * @returns 1 if the message is an ack, 0 if it is a nack or malformed
+ * @remarks A zero length message is an ack with no flags
+ */
+int CATUI_API catui_decode_ack(const void *buf, size_t msgsz,
+                               catui_ack_info *info);
+
+/**
+ * Connect to a catui server with the given protocol, version, and options
+ * @param[in] proto The device communication protocol to connect to
+ * @param[in] semver The version of the protocol required for communication
+ * @param[in] flags Bitwise OR of CATUI_CONNECT_* options to request
+ * @param[out] info Optional structure to hold what the server said in its ack
+ * @param[in] err Pointer to a stream that will have an error written if present
+ * @returns A file descriptor of the connection on success, -1 on failure
+ * @remarks Servers that predate an option ack without agreeing to it. Check
+ * info->flags for CATUI_CONNECT_ACK_INFO before reading the version and
+ * capabilities. Fails if CATUI_CONNECT_MULTIPLEX is requested and not agreed.
+ */
+int CATUI_API catui_connect_ex(const char *proto, const char *semver,
+                               uint32_t flags, catui_ack_info *info,
+                               FILE *err);
+
+/**
+ * A protocol and version to connect to with catui_connect_many
+ */
+typedef struct {
+  /// The device communication protocol to connect to
+  const char *protocol;
+  /// The version of the protocol required for communication
+  const char *semver;
+} catui_connect_target;
+
+/**
+ * Why catui_connect_many failed to connect to a target
+ */
+typedef enum {
+  /// Connected
+  CATUI_CONNECT_ERROR_NONE = 0,
+  /// Failed to allocate a socket or the call's own state
+  CATUI_CONNECT_ERROR_SOCKET = 1,
+  /// Failed to connect to the load balancer
+  CATUI_CONNECT_ERROR_CONNECT = 2,
+  /// Failed to send the connect request
+  CATUI_CONNECT_ERROR_SEND = 3,
+  /// Failed to read the response to the connect request
+  CATUI_CONNECT_ERROR_RECV = 4,
+  /// The load balancer or server rejected the connect request
+  CATUI_CONNECT_ERROR_NACK = 5,
+  /// Failed to wait on the other connections
+  CATUI_CONNECT_ERROR_POLL = 6
+} catui_connect_error;
+
+/**
+ * Connect to several catui servers with their handshakes in flight at once
+ * @param[in] targets The protocols and versions to connect to
+ * @param[in] n The number of entries in targets
+ * @param[out] fds Array of n file descriptors. Each entry is the connection
+ * to the corresponding target on success, -1 on failure
+ * @param[out] errors Optional array of n catui_connect_error values saying why
+ * each corresponding target failed, or CATUI_CONNECT_ERROR_NONE
+ * @param[in] err Pointer to a stream that will have errors written if present
+ * @returns The number of successful connections
+ * @remarks Sockets are connected without blocking and every connect request
+ * is sent before waiting on any ack, so the call costs about one handshake
+ * round trip instead of n
+ */
+size_t CATUI_API catui_connect_many(const catui_connect_target *targets,
+                                    size_t n, int *fds, int *errors,
+                                    FILE *err);
+
+/**
+ * Encode an ack response saying what the server agreed to
+ *
+ * @param info The requested options the server agreed to, with its exact
+ * version and capabilities when flags has CATUI_CONNECT_ACK_INFO
+ * @param buf Buffer to hold bytes
+ * @param buf_size size of allocated buffer 'buf'
+ * @param err Optional stream for error messages to be written to
+ * @returns size of message if successful, < 0 on error
+ * @remarks Only agree to options the client requested. With no flags this is
+ * the same zero length message as catui_server_encode_ack
+ */
+int16_t CATUI_API catui_server_encode_ack_info(const catui_ack_info *info,
+                                               void *buf, size_t buf_size,
+                                               FILE *err);
+
+/**
+ * Send an ack message saying what the server agreed to
+ * @param fd The file descriptor to write to
+ * @param info The requested options the server agreed to
+ * @param err A stream that will have an error message written if applicable
+ * @returns size of message if successful, < 0 on error
+ */
+int16_t CATUI_API catui_server_ack_info(int fd, const catui_ack_info *info,
+                                        FILE *err);
+
+/**
+ * A protocol version that a server supports
+ */
+typedef struct {
+  /// The protocol of the device the server implements
+  const char *protocol;
+
+  /// The version of the protocol the server implements
+  catui_semver version;
+
+  /// Bitwise OR of CATUI_CONNECT_* options the server supports
+  uint32_t flags;
+
+  /// Capability bitmap advertised to clients requesting CATUI_CONNECT_ACK_INFO
+  uint32_t capabilities;
+} catui_server_protocol;
+
+/**
+ * Receive and decode a connect request, then ack or nack it based on a table
+ * of supported protocol versions
+ * @param[in] con A connection from catui_server_accept
+ * @param[in] protocols The protocol versions the server supports
+ * @param[in] n The number of entries in protocols
+ * @param[out] req Optional structure to hold the decoded request
+ * @param[out] flags Optional. The requested CATUI_CONNECT_* options narrowed
+ * to those the matched entry supports. The ack advertises the matched entry's
+ * version and capabilities when requested.
+ * @param[in] err A stream that will have an error message written if applicable
+ * @returns The first entry in protocols that can support the request, NULL if
+ * the request was nacked or the handshake failed
+ * @remarks Nothing is allocated on the heap unless the request needs the
+ * general JSON parser, like one with escaped strings
+ */
+const catui_server_protocol *CATUI_API
+catui_server_handshake(int con, const catui_server_protocol *protocols,
+                       size_t n, catui_connect_request *req, uint32_t *flags,
+                       FILE *err);
+
+/// Requests larger than this are never cached by catui_route_cache
+#define CATUI_ROUTE_KEY_SIZE 256
+
+/**
+ * Bounded, thread safe cache of routing decisions keyed by the raw bytes of
+ * a connect request
+ */
+typedef struct catui_route_cache catui_route_cache;
+
+/**
+ * Create a routing decision cache
+ * @param capacity The maximum number of cached decisions
+ * @returns A new cache on success, NULL on failure
+ */
+catui_route_cache *CATUI_API catui_route_cache_create(size_t capacity);
+
+/**
+ * Destroy a routing decision cache
+ * @param c The cache to destroy. May be NULL
+ */
+void CATUI_API catui_route_cache_destroy(catui_route_cache *c);
+
+/**
+ * Look up the routing decision for a connect request
+ * @param[in] c The cache
+ * @param[in] req The raw bytes of the connect request
+ * @param[in] reqsz The size of req in bytes
+ * @param[out] route The cached decision on a hit
+ * @param[out] generation Optional. The token to give catui_route_cache_put
+ * when caching a decision made after a miss
+ * @returns 1 on a hit, 0 on a miss
+ */
+int CATUI_API catui_route_cache_get(catui_route_cache *c, const void *req,
+                                    size_t reqsz, int *route,
+                                    uint64_t *generation);
+
+/**
+ * Cache the routing decision for a connect request
+ * @param c The cache
+ * @param req The raw bytes of the connect request
+ * @param reqsz The size of req in bytes
+ * @param route The decision to cache, like a server index
+ * @param generation The token from the catui_route_cache_get miss that
+ * preceded the decision
+ * @remarks Nothing is cached if the cache was invalidated after the miss
+ */
+void CATUI_API catui_route_cache_put(catui_route_cache *c, const void *req,
+                                     size_t reqsz, int route,
+                                     uint64_t generation);
+
+/**
+ * Drop every cached decision, like when a server registers or exits
+ * @param c The cache
+ */
+void CATUI_API catui_route_cache_invalidate(catui_route_cache *c);
+
+/**
+ * Pool of prespawned server processes for one protocol, used by a load
+ * balancer to hand connections to servers that have already started
+ */
+typedef struct catui_pool catui_pool;
+
+/**
+ * Create a pool that keeps a number of idle server processes ready
+ * @param argv Null terminated command to spawn a server, searched for in PATH.
+ * Must outlive the pool
+ * @param size The number of idle servers to keep ready. 0 spawns a server for
+ * each connection
+ * @param err A stream that will have an error message written if applicable.
+ * The pool's background thread also writes to it, so it must outlive the pool
+ * @returns A new pool on success, NULL on failure, including when size is not
+ * 0 and the first server fails to spawn
+ * @remarks Each server is spawned with CATUI_LOAD_BALANCER_FD set to its end
+ * of a channel, so it finds the channel with catui_server_fd. A background
+ * thread replaces servers as they are dispatched and reaps exited servers. It
+ * waits longer between attempts while spawns fail or idle servers exit.
+ */
+catui_pool *CATUI_API catui_pool_create(char *const *argv, size_t size,
+                                        FILE *err);
+
+/**
+ * Hand a connection to a ready server, spawning one if none are idle
+ * @param p The pool
+ * @param con The connection to hand off. Still owned by the caller
+ * @param err A stream that will have an error message written if applicable
+ * @returns 0 on success, -1 on failure
+ * @remarks Each server is given exactly one connection, after which its
+ * channel is closed and catui_server_accept fails. The caller should ignore
+ * SIGPIPE in case an idle server died since it was last checked.
+ */
+int CATUI_API catui_pool_dispatch(catui_pool *p, int con, FILE *err);
+
+/**
+ * Destroy a pool, waiting for idle servers to exit after closing their
+ * channels
+ * @param p The pool to destroy. May be NULL
+ * @remarks Also waits for every server that was given a connection to exit,
+ * so this blocks until their sessions end
+ */
+void CATUI_API catui_pool_destroy(catui_pool *p);
+
+#define CATUI_LOAD_REPORT_SIZE 128
+
+/**
+ * Load a server reports to the load balancer over its load balancer channel
+ */
+typedef struct {
+  /// The number of connections the server is currently serving
+  uint32_t active_sessions;
+
+  /// The number of connections or requests waiting to be served
+  uint32_t queue_depth;
+} catui_load_report;
+
+/**
+ * Encode a load report to be sent as a msgstream message
+ *
+ * @param report The load to report
+ * @param buf Buffer to hold bytes
+ * @param buf_size size of allocated buffer 'buf'
+ * @param err Optional stream for error messages to be written to
+ * @returns size of message if successful, < 0 on error
+ */
+int16_t CATUI_API catui_server_encode_load_report(
+    const catui_load_report *report, void *buf, size_t buf_size, FILE *err);
+
+/**
+ * Send a load report to the load balancer
+ * @param fd The load balancer channel from catui_server_fd
+ * @param report The load to report
+ * @param err A stream that will have an error message written if applicable
+ * @returns 0 on success, < 0 on error
+ * @remarks Only send reports to a load balancer that reads them, or the
+ * channel eventually fills and this blocks
+ */
+int16_t CATUI_API catui_server_report_load(int fd,
+                                           const catui_load_report *report,
+                                           FILE *err);
+
+/**
+ * Decode a load report
+ * @param[in] buf The buffer containing the encoded bytes
+ * @param[in] msgsz The size of the encoded message
+ * @param[out] report The structure to hold the decoded report
+ * @returns 1 on success, 0 on failure
+ */
+int CATUI_API catui_decode_load_report(const void *buf, size_t msgsz,
+                                       catui_load_report *report);
+
+/**
+ * Receive a load report from a server's channel
+ * @param[in] fd The load balancer's end of the server's channel
+ * @param[out] report The structure to hold the received report
+ * @param[in] err A stream that will have an error message written if applicable
+ * @returns 0 on success, -1 on failure
+ */
+int CATUI_API catui_recv_load_report(int fd, catui_load_report *report,
+                                     FILE *err);
+
+/**
+ * Pick the less loaded of two random compatible servers
+ * @param[in] reports The latest load of each compatible server
+ * @param[in] n The number of entries in reports
+ * @param[in,out] seed Random state owned by the caller
+ * @returns The index of the picked server, -1 if n is 0
+ * @remarks Load is active sessions plus queue depth. Count connections
+ * dispatched since a server's last report toward its load so a burst between
+ * reports is spread out.
+ */
+int CATUI_API catui_route_least_loaded(const catui_load_report *reports,
+                                       size_t n, uint32_t *seed);
+
+#define CATUI_HANDOVER_SIZE 64
+
+/**
+ * Hand a load balancer's listening socket and server channels to a new load
+ * balancer instance, like during a restart
+ * @param chan A unix socket connected to the new instance
+ * @param listen_fd The socket that catui_connect clients connect to
+ * @param server_fds The load balancer's end of each server's channel
+ * @param n The number of entries in server_fds
+ * @param err A stream that will have an error message written if applicable
+ * @returns 0 once the new instance has acknowledged owning every descriptor,
+ * -1 on failure
+ * @remarks Stop accepting on listen_fd and finish in-flight handshakes before
+ * calling. Clients that connect meanwhile wait in the listen backlog for the
+ * new instance. On failure the caller still owns its descriptors and may
+ * resume routing.
+ */
+int CATUI_API catui_handover_send(int chan, int listen_fd,
+                                  const int *server_fds, size_t n, FILE *err);
+
+/**
+ * Receive a listening socket and server channels from a load balancer
+ * instance calling catui_handover_send
+ * @param[in] chan A unix socket connected to the old instance
+ * @param[out] listen_fd The socket that catui_connect clients connect to
+ * @param[out] server_fds Array to hold the server channels
+ * @param[in] server_fds_size The number of entries server_fds can hold
+ * @param[out] n The number of server channels received
+ * @param[in] err A stream that will have an error message written if applicable
+ * @returns 0 on success, -1 on failure
+ */
+int CATUI_API catui_handover_recv(int chan, int *listen_fd, int *server_fds,
+                                  size_t server_fds_size, size_t *n,
+                                  FILE *err);
+
+#define CATUI_MUX_HEADER_SIZE 9
+#define CATUI_MUX_FRAME_SIZE 4096
+#define CATUI_MUX_PAYLOAD_SIZE (CATUI_MUX_FRAME_SIZE - CATUI_MUX_HEADER_SIZE)
+
+/**
+ * Kinds of frames sent over a multiplexed connection
+ */
+typedef enum {
+  /// Open a logical session. value is the opener's receive window
+  CATUI_MUX_OPEN = 1,
+  /// Accept an opened session. value is the acceptor's receive window
+  CATUI_MUX_ACK = 2,
+  /// Reject an opened session. Payload is an optional error message
+  CATUI_MUX_NACK = 3,
+  /// Session data. value is the payload size
+  CATUI_MUX_DATA = 4,
+  /// Grant the peer value more bytes of send window
+  CATUI_MUX_WINDOW = 5,
+  /// Close a logical session
+  CATUI_MUX_CLOSE = 6
+} catui_mux_frame_type;
+
+/**
+ * Header of a frame on a multiplexed connection
+ */
+typedef struct {
+  /// One of catui_mux_frame_type
+  uint8_t type;
+  /// The logical session the frame belongs to
+  uint32_t stream_id;
+  /// Meaning depends on type
+  uint32_t value;
+} catui_mux_frame;
+
+/**
+ * States of a logical session on a multiplexed connection
+ */
+typedef enum {
+  /// Accepted by either side
+  CATUI_MUX_SESSION_OPEN = 0,
+  /// Opened by us and waiting for the peer's CATUI_MUX_ACK or CATUI_MUX_NACK
+  CATUI_MUX_SESSION_OPENING = 1,
+  /// Rejected by the peer with CATUI_MUX_NACK
+  CATUI_MUX_SESSION_REJECTED = 2,
+  /// Closed by the peer with CATUI_MUX_CLOSE
+  CATUI_MUX_SESSION_CLOSED = 3
+} catui_mux_session_state;
+
+/**
+ * Flow control state of one logical session on a multiplexed connection
+ */
+typedef struct {
+  /// The logical session's stream ID
+  uint32_t stream_id;
+  /// Bytes that may be sent before the peer grants more window
+  uint32_t send_window;
+  /// Bytes the peer may send before we grant more window
+  uint32_t recv_window;
+  /// One of catui_mux_session_state
+  uint32_t state;
+} catui_mux_session;
+
+/**
+ * Encode a multiplexed frame header
+ * @param[in] f The frame header to encode
+ * @param[in] buf The buffer to encode the header to
+ * @param[in] bufsz The size of buf in bytes
+ * @returns 1 on success, 0 on failure
+ * @remarks Exactly CATUI_MUX_HEADER_SIZE bytes are written
+ */
+int CATUI_API catui_mux_encode_frame(const catui_mux_frame *f, void *buf,
+                                     size_t bufsz);
+
+/**
+ * Decode a multiplexed frame header
+ * @param[in] buf The buffer containing the encoded bytes
+ * @param[in] bufsz The size of buf in bytes
+ * @param[out] f The structure to hold the decoded header
+ * @returns 1 on success, 0 on failure
+ */
+int CATUI_API catui_mux_decode_frame(const void *buf, size_t bufsz,
+                                     catui_mux_frame *f);
+
+/**
+ * Send a single frame on a multiplexed connection
+ * @param fd The multiplexed connection
+ * @param f The frame header
+ * @param payload Bytes following the header. May be NULL when f has no payload
+ * @param payload_size Size of payload in bytes
+ * @param err A stream that will have an error message written if applicable
+ * @returns 0 on success, -1 on failure
+ */
+int CATUI_API catui_mux_send_frame(int fd, const catui_mux_frame *f,
+                                   const void *payload, size_t payload_size,
+                                   FILE *err);
+
+/**
+ * Receive a single frame from a multiplexed connection
+ * @param[in] fd The multiplexed connection
+ * @param[out] f The received frame header
+ * @param[out] payload Buffer to hold the frame's payload
+ * @param[in] payload_size Size of payload in bytes
+ * @param[out] nread Size of the received payload in bytes
+ * @param[in] err A stream that will have an error message written if applicable
+ * @returns 0 on success, -1 on failure
+ */
+int CATUI_API catui_mux_recv_frame(int fd, catui_mux_frame *f, void *payload,
+                                   size_t payload_size, size_t *nread,
+                                   FILE *err);
+
+/**
+ * Open a logical session on a multiplexed connection
+ * @param fd The multiplexed connection
+ * @param s The session state to initialize
+ * @param stream_id The stream ID of the new session, unique on fd
+ * @param window The number of bytes the peer may initially send
+ * @param err A stream that will have an error message written if applicable
+ * @returns 0 on success, -1 on failure
+ * @remarks The session cannot send data until the peer's CATUI_MUX_ACK frame
+ * is given to catui_mux_update
+ */
+int CATUI_API catui_mux_open(int fd, catui_mux_session *s, uint32_t stream_id,
+                             uint32_t window, FILE *err);
+
+/**
+ * Accept a logical session opened by the peer
+ * @param fd The multiplexed connection
+ * @param s The session state to initialize
+ * @param open The received CATUI_MUX_OPEN frame
+ * @param window The number of bytes the peer may initially send
+ * @param err A stream that will have an error message written if applicable
+ * @returns 0 on success, -1 on failure
+ */
+int CATUI_API catui_mux_accept(int fd, catui_mux_session *s,
+                               const catui_mux_frame *open, uint32_t window,
+                               FILE *err);
+
+/**
+ * Reject a logical session opened by the peer
+ * @param fd The multiplexed connection
+ * @param open The received CATUI_MUX_OPEN frame
+ * @param reason Optional error message for the peer. May be NULL
+ * @param err A stream that will have an error message written if applicable
+ * @returns 0 on success, -1 on failure
+ */
+int CATUI_API catui_mux_reject(int fd, const catui_mux_frame *open,
+                               const char *reason, FILE *err);
+
+/**
+ * Send session data on a multiplexed connection
+ * @param fd The multiplexed connection
+ * @param s The session to send data on
+ * @param data The bytes to send
+ * @param size The number of bytes to send
+ * @param err A stream that will have an error message written if applicable
+ * @returns 0 on success, -1 on failure
+ * @remarks Fails without sending if size exceeds the session's send window or
+ * CATUI_MUX_PAYLOAD_SIZE
+ */
+int CATUI_API catui_mux_send(int fd, catui_mux_session *s, const void *data,
+                             size_t size, FILE *err);
+
+/**
+ * Grant the peer more send window on a session
+ * @param fd The multiplexed connection
+ * @param s The session to grant window on
+ * @param size The number of additional bytes the peer may send
+ * @param err A stream that will have an error message written if applicable
+ * @returns 0 on success, -1 on failure
+ */
+int CATUI_API catui_mux_grant(int fd, catui_mux_session *s, uint32_t size,
+                              FILE *err);
+
+/**
+ * Close a logical session on a multiplexed connection
+ * @param fd The multiplexed connection
+ * @param s The session to close
+ * @param err A stream that will have an error message written if applicable
+ * @returns 0 on success, -1 on failure
+ */
+int CATUI_API catui_mux_close(int fd, const catui_mux_session *s, FILE *err);
+
+/**
+ * Update a session's flow control state with a frame received for it
+ * @param s The session that f belongs to
+ * @param f The received frame
+ * @returns 1 on success, 0 if the frame violates flow control or the session's
+ * state, like a CATUI_MUX_ACK for a session that is not opening or any frame
+ * for a session that was rejected or closed
+ * @remarks A CATUI_MUX_NACK or CATUI_MUX_CLOSE moves the session to
+ * CATUI_MUX_SESSION_REJECTED or CATUI_MUX_SESSION_CLOSED
+ */
+int CATUI_API catui_mux_update(catui_mux_session *s, const catui_mux_frame *f);
+
+/**
+ * Handshake events recorded by catui_trace
+ */
+typedef enum {
+  /// A client began connecting. fd is the client socket
+  CATUI_TRACE_CONNECT_START = 1,
+  /// A client sent its connect request
+  CATUI_TRACE_REQUEST_SENT = 2,
+  /// A client received an ack
+  CATUI_TRACE_ACK_RECEIVED = 3,
+  /// A client received a nack
+  CATUI_TRACE_NACK_RECEIVED = 4,
+  /// A server accepted a connection from the load balancer
+  CATUI_TRACE_FD_ACCEPTED = 5,
+  /// A server sent an ack
+  CATUI_TRACE_ACK_SENT = 6,
+  /// A server sent a nack
+  CATUI_TRACE_NACK_SENT = 7
+} catui_trace_event_type;
+
+/**
+ * A single recorded trace event
+ */
+typedef struct {
+  /// CLOCK_MONOTONIC time of the event in nanoseconds
+  uint64_t time_ns;
+  /// Index of the recording thread within the process, starting at 1
+  uint32_t thread;
+  /// The file descriptor the event applies to
+  int32_t fd;
+  /// One of catui_trace_event_type
+  uint32_t type;
+} catui_trace_event;
+
+/// First word of a trace dump
+#define CATUI_TRACE_MAGIC 0x63617474
+#define CATUI_TRACE_FORMAT_VERSION 1
+
+/**
+ * Start recording handshake events into per-thread ring buffers
+ * @param events_per_thread Number of most recent events each thread keeps.
+ * Rounded up to a power of two
+ * @returns 1 on success, 0 on failure
+ * @remarks The capacity applies to threads that have not yet recorded an event.
+ * Once a thread's ring wraps, dumps leave out its oldest slot because it may
+ * be mid overwrite.
+ */
+int CATUI_API catui_trace_enable(size_t events_per_thread);
+
+/**
+ * Stop recording handshake events. Recorded events are kept for dumping
+ */
+void CATUI_API catui_trace_disable(void);
+
+/**
+ * Record a handshake event on the calling thread's ring buffer
+ * @param type The kind of event
+ * @param fd The file descriptor the event applies to
+ * @remarks Does nothing unless tracing is enabled. Never locks or blocks.
+ */
+void CATUI_API catui_trace(catui_trace_event_type type, int fd);
+
+/**
+ * Write every thread's recorded events to a file descriptor
+ * @param fd The file descriptor to write the dump to
+ * @param err A stream that will have an error message written if applicable
+ * @returns 0 on success, -1 on failure
+ * @remarks The dump is four uint32_t words (CATUI_TRACE_MAGIC,
+ * CATUI_TRACE_FORMAT_VERSION, sizeof(catui_trace_event), 0) followed by
+ * catui_trace_event structures in native byte order
+ */
+int CATUI_API catui_trace_dump(int fd, FILE *err);
+
+/**
+ * Dump recorded events to a file whenever a signal is received
+ * @param signum The signal that triggers a dump, like SIGUSR1
+ * @param path The file to overwrite with each dump
+ * @param err A stream that will have an error message written if applicable
+ * @returns 0 on success, -1 on failure
+ */
+int CATUI_API catui_trace_dump_on_signal(int signum, const char *path,
+                                         FILE *err);
+
+/**
+ * Get a short human readable name for a trace event type
+ * @param type The event type
+ * @returns A static C string
+ */
+const char *CATUI_API catui_trace_event_name(catui_trace_event_type type);
+
 #ifdef __cplusplus
 }
 #endif
@@ -28,18 +28,43 @@ cli((make) => {
 
   const catui = d.addLibrary({
     name: "catui",
-    src: ["src/catui.c", "src/catui_server.c"],
+    src: [
+      "src/catui.c",
+      "src/catui_server.c",
+      "src/catui_handover.c",
+      "src/catui_mux.c",
+      "src/catui_pool.c",
+      "src/catui_route.c",
+      "src/catui_trace.c",
+    ],
     linkTo: [unix, msgstream, cjson],
   });
 
+  const loadgen = d.addExecutable({
+    name: "catui_loadgen",
+    src: ["tool/catui_loadgen.c"],
+    linkTo: [catui, unix, msgstream],
+  });
+
+  const timeline = d.addExecutable({
+    name: "catui_trace_timeline",
+    src: ["tool/catui_trace_timeline.c"],
+    linkTo: [catui],
+  });
+
   const test = d.addTest({
     name: "catui_test",
     src: ["test/catui_test.cpp"],
-    linkTo: [catui, gtest],
+    linkTo: [catui, unix, msgstream, cjson, gtest],
   });
 
   const cmds = addCompileCommands(make, d);
 
-  make.add("all", [cmds, catui.binary]);
+  make.add("all", [
+    cmds,
+    catui.binary,
+    loadgen.binary,
+    timeline.binary,
+  ]);
   make.add("test", [test.run], () => {});
 });
@@ -1,4 +1,4 @@
-set path=,,src/**,include/**,test/**
+set path=,,src/**,include/**,test/**,tool/**
 nnoremap <F5> :!node make.mjs serve<CR>
 
 augroup msgstream
@@ -12,65 +12,393 @@
 #include <assert.h>
 #include <cjson/cJSON.h>
 #include <ctype.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/errno.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include <unistd.h>
 
-static const char *catui_address() {
+#define CATUI_ADDRESS_SIZE sizeof(((struct sockaddr_un *)0)->sun_path)
+
+// resolved once per process by resolve_address
+static pthread_once_t address_once_ = PTHREAD_ONCE_INIT;
+static char address_[CATUI_ADDRESS_SIZE + 1];
+static struct sockaddr_un sockaddr_;
+static socklen_t sockaddr_len_;
+
+// Resolve the load balancer address, in order of preference:
+// 1. CATUI_ADDRESS, where a leading '@' names a Linux abstract socket
+// 2. $XDG_RUNTIME_DIR/catui/load_balancer.sock
+// 3. A per-user platform default
+static void resolve_address() {
+  const char *home = getenv("HOME");
+  if (!home)
+    home = "";
+
   const char *address = getenv("CATUI_ADDRESS");
+  const char *runtime_dir = getenv("XDG_RUNTIME_DIR");
+
+  int n;
+  if (address && address[0] == '~' && address[1] == '/') {
+    n = snprintf(address_, sizeof(address_), "%s%s", home, address + 1);
+  } else if (address) {
+    n = snprintf(address_, sizeof(address_), "%s", address);
+  } else if (runtime_dir && *runtime_dir) {
+    n = snprintf(address_, sizeof(address_), "%s/catui/load_balancer.sock",
+                 runtime_dir);
+  } else {
+#ifdef __APPLE__
+    n = snprintf(address_, sizeof(address_),
+                 "%s/Library/Caches/TemporaryItems/catui/load_balancer.sock",
+                 home);
+#else
+    n = snprintf(address_, sizeof(address_), "/tmp/catui-%u/load_balancer.sock",
+                 (unsigned)getuid());
+#endif
+  }
 
-  if (address)
-    return address;
+  // leave sockaddr_len_ zero so connecting reports the bad address
+  if (n < 0 || n >= (int)sizeof(address_))
+    return;
+
+  memset(&sockaddr_, 0, sizeof(sockaddr_));
+  sockaddr_.sun_family = AF_UNIX;
+
+  size_t len = (size_t)n;
+  if (address_[0] == '@') {
+#ifdef __linux__
+    // abstract names are not null terminated and skip the filesystem
+    memcpy(sockaddr_.sun_path + 1, address_ + 1, len - 1);
+    sockaddr_len_ = offsetof(struct sockaddr_un, sun_path) + len;
+#endif
+  } else if (len < CATUI_ADDRESS_SIZE) {
+    memcpy(sockaddr_.sun_path, address_, len);
+    sockaddr_len_ = sizeof(sockaddr_);
+  }
+}
 
-  // hard coded for mac
-  return "~/Library/Caches/TemporaryItems/catui/load_balancer.sock";
+static const char *catui_address() {
+  pthread_once(&address_once_, resolve_address);
+  return address_;
 }
 
-int catui_connect(const char *proto, const char *semver, FILE *err) {
-  const char *addr = catui_address();
+static int catui_address_connect(int sock) {
+  pthread_once(&address_once_, resolve_address);
 
-  int sock = unix_socket();
-  if (sock == -1) {
-    fprintf(err, "Failed to allocate unix_socket\n");
+  if (sockaddr_len_ == 0) {
+    errno = EINVAL;
     return -1;
   }
 
-  if (unix_connect(sock, addr) == -1) {
-    fprintf(err, "Failed to connect to %s\n", addr);
-    return -1;
-  }
+  return connect(sock, (const struct sockaddr *)&sockaddr_, sockaddr_len_);
+}
 
+// Send a connect request on a connected socket
+static int send_connect_request(int sock, const char *proto,
+                                const char *semver, uint32_t flags,
+                                FILE *err) {
   char buf[CATUI_CONNECT_SIZE];
 
-  ssize_t n = snprintf(
-      buf, sizeof(buf),
-      "{\"catui-version\":\"0.1.0\",\"protocol\":\"%s\",\"version\":\"%s\"}",
-      proto, semver);
+  const char *mux =
+      (flags & CATUI_CONNECT_MULTIPLEX) ? ",\"multiplex\":true" : "";
+  const char *ack_info =
+      (flags & CATUI_CONNECT_ACK_INFO) ? ",\"ack-info\":true" : "";
+
+  ssize_t n = snprintf(buf, sizeof(buf),
+                       "{\"catui-version\":\"0.1.0\",\"protocol\":\"%s\","
+                       "\"version\":\"%s\"%s%s}",
+                       proto, semver, mux, ack_info);
 
   if (msgstream_fd_send(sock, buf, sizeof(buf), n)) {
     fprintf(err, "Failed to send handshake request\n");
     return -1;
   }
 
+  catui_trace(CATUI_TRACE_REQUEST_SENT, sock);
+  return 0;
+}
+
+// Open a socket to the load balancer and send a connect request
+static int send_request(const char *proto, const char *semver, uint32_t flags,
+                        FILE *err) {
+  int sock = unix_socket();
+  if (sock == -1) {
+    fprintf(err, "Failed to allocate unix_socket\n");
+    return -1;
+  }
+
+  catui_trace(CATUI_TRACE_CONNECT_START, sock);
+
+  if (catui_address_connect(sock) == -1) {
+    fprintf(err, "Failed to connect to %s\n", catui_address());
+    close(sock);
+    return -1;
+  }
+
+  if (send_connect_request(sock, proto, semver, flags, err) == -1) {
+    close(sock);
+    return -1;
+  }
+
+  return sock;
+}
+
+// Receive the response to send_request. Closes sock and sets *error on
+// failure
+static int recv_ack(int sock, uint32_t flags, catui_ack_info *info,
+                    catui_connect_error *error, FILE *err) {
+  char buf[CATUI_ACK_SIZE];
+
   size_t msg_size;
   int ec = msgstream_fd_recv(sock, buf, sizeof(buf), &msg_size);
   if (ec) {
     fprintf(err, "Failed to read ack response: %s\n", msgstream_errstr(ec));
+    *error = CATUI_CONNECT_ERROR_RECV;
+    close(sock);
     return -1;
   }
 
-  // zero length error message means success
-  if (msg_size != 0) {
+  // servers only send a non-empty ack when asked to, so without flags any
+  // message is an error message
+  if ((flags == 0 && msg_size != 0) ||
+      !catui_decode_ack(buf, msg_size, info)) {
+    catui_trace(CATUI_TRACE_NACK_RECEIVED, sock);
     fprintf(err, "Received a nack response from server\n");
+    *error = CATUI_CONNECT_ERROR_NACK;
+    close(sock);
+    return -1;
+  }
+
+  catui_trace(CATUI_TRACE_ACK_RECEIVED, sock);
+
+  // a multiplexed connection is only established if the server says so
+  if ((flags & CATUI_CONNECT_MULTIPLEX) &&
+      !(info->flags & CATUI_CONNECT_MULTIPLEX)) {
+    fprintf(err, "Server does not support multiplexed sessions\n");
+    *error = CATUI_CONNECT_ERROR_NACK;
+    close(sock);
     return -1;
   }
 
+  *error = CATUI_CONNECT_ERROR_NONE;
   return sock;
 }
 
+int catui_connect_ex(const char *proto, const char *semver, uint32_t flags,
+                     catui_ack_info *info, FILE *err) {
+  catui_ack_info fallback_info;
+  if (!info)
+    info = &fallback_info;
+
+  int sock = send_request(proto, semver, flags, err);
+  if (sock == -1)
+    return -1;
+
+  catui_connect_error error;
+  return recv_ack(sock, flags, info, &error, err);
+}
+
+// how long catui_connect_many waits before retrying a connect that was
+// refused because the load balancer's backlog is full
+#define CONNECT_RETRY_MS 10
+
+// where a catui_connect_many entry is in its handshake
+enum {
+  // connect now, or again if the backlog was full
+  MANY_CONNECT,
+  // connect is in progress. Wait for the socket to be writable
+  MANY_CONNECTING,
+  // request is sent. Wait for the ack
+  MANY_AWAITING_ACK,
+  MANY_DONE
+};
+
+typedef struct {
+  int state;
+  catui_connect_error error;
+} many_entry;
+
+static int set_nonblocking(int fd, int nonblocking) {
+  int flags = fcntl(fd, F_GETFL);
+  if (flags == -1)
+    return -1;
+
+  flags = nonblocking ? flags | O_NONBLOCK : flags & ~O_NONBLOCK;
+  return fcntl(fd, F_SETFL, flags);
+}
+
+static void many_fail(many_entry *e, int *fd, catui_connect_error error) {
+  close(*fd);
+  *fd = -1;
+  e->state = MANY_DONE;
+  e->error = error;
+}
+
+// Move a catui_connect_many entry along its handshake as far as it goes
+// without blocking. Sets p to what the entry waits on next, if anything
+static void many_step(const catui_connect_target *target, many_entry *e,
+                      int *fd, struct pollfd *p, FILE *err) {
+  // poll ignores negative file descriptors
+  p->fd = -1;
+
+  switch (e->state) {
+  case MANY_CONNECT:
+    if (catui_address_connect(*fd) == 0)
+      break;
+
+    // a full backlog is not queued. Leave the entry to be retried
+    if (errno == EAGAIN)
+      return;
+
+    if (errno == EINPROGRESS) {
+      e->state = MANY_CONNECTING;
+      p->fd = *fd;
+      p->events = POLLOUT;
+      return;
+    }
+
+    fprintf(err, "Failed to connect to %s\n", catui_address());
+    many_fail(e, fd, CATUI_CONNECT_ERROR_CONNECT);
+    return;
+  case MANY_CONNECTING: {
+    int ec;
+    socklen_t len = sizeof(ec);
+    if (getsockopt(*fd, SOL_SOCKET, SO_ERROR, &ec, &len) == -1 || ec) {
+      fprintf(err, "Failed to connect to %s\n", catui_address());
+      many_fail(e, fd, CATUI_CONNECT_ERROR_CONNECT);
+      return;
+    }
+    break;
+  }
+  case MANY_AWAITING_ACK: {
+    catui_ack_info info;
+    *fd = recv_ack(*fd, 0, &info, &e->error, err);
+    e->state = MANY_DONE;
+    return;
+  }
+  default:
+    return;
+  }
+
+  // connected. The request fits in an empty socket buffer, and callers
+  // expect a blocking connection like catui_connect's
+  if (set_nonblocking(*fd, 0) == -1 ||
+      send_connect_request(*fd, target->protocol, target->semver, 0, err)) {
+    many_fail(e, fd, CATUI_CONNECT_ERROR_SEND);
+    return;
+  }
+
+  e->state = MANY_AWAITING_ACK;
+  p->fd = *fd;
+  p->events = POLLIN;
+}
+
+size_t catui_connect_many(const catui_connect_target *targets, size_t n,
+                          int *fds, int *errors, FILE *err) {
+  struct pollfd *pending = calloc(n, sizeof(struct pollfd));
+  many_entry *entries = calloc(n, sizeof(many_entry));
+  if (n > 0 && !(pending && entries)) {
+    fprintf(err, "Failed to allocate memory for %lu connections\n", n);
+    for (size_t i = 0; i < n; ++i) {
+      fds[i] = -1;
+      if (errors)
+        errors[i] = CATUI_CONNECT_ERROR_SOCKET;
+    }
+
+    free(pending);
+    free(entries);
+    return 0;
+  }
+
+  // every socket connects and sends its request before waiting on any ack
+  size_t nactive = 0;
+  for (size_t i = 0; i < n; ++i) {
+    many_entry *e = &entries[i];
+    pending[i].fd = -1;
+
+    fds[i] = unix_socket();
+    if (fds[i] == -1) {
+      fprintf(err, "Failed to allocate unix_socket\n");
+      e->state = MANY_DONE;
+      e->error = CATUI_CONNECT_ERROR_SOCKET;
+      continue;
+    }
+
+    catui_trace(CATUI_TRACE_CONNECT_START, fds[i]);
+
+    if (set_nonblocking(fds[i], 1) == -1) {
+      fprintf(err, "Failed to make socket non-blocking\n");
+      many_fail(e, &fds[i], CATUI_CONNECT_ERROR_CONNECT);
+      continue;
+    }
+
+    e->state = MANY_CONNECT;
+    many_step(&targets[i], e, &fds[i], &pending[i], err);
+    if (e->state != MANY_DONE)
+      nactive += 1;
+  }
+
+  while (nactive > 0) {
+    int retrying = 0;
+    for (size_t i = 0; i < n; ++i)
+      retrying |= entries[i].state == MANY_CONNECT;
+
+    if (poll(pending, n, retrying ? CONNECT_RETRY_MS : -1) == -1) {
+      if (errno == EINTR)
+        continue;
+
+      fprintf(err, "Failed to poll for ack responses: %s\n", strerror(errno));
+      break;
+    }
+
+    nactive = 0;
+    for (size_t i = 0; i < n; ++i) {
+      many_entry *e = &entries[i];
+      if (e->state == MANY_CONNECT || pending[i].revents)
+        many_step(&targets[i], e, &fds[i], &pending[i], err);
+
+      if (e->state != MANY_DONE)
+        nactive += 1;
+    }
+  }
+
+  size_t nconnected = 0;
+  for (size_t i = 0; i < n; ++i) {
+    many_entry *e = &entries[i];
+
+    // only reached on poll failure
+    if (e->state != MANY_DONE)
+      many_fail(e, &fds[i], CATUI_CONNECT_ERROR_POLL);
+
+    if (fds[i] == -1)
+      fprintf(err, "Failed to connect to '%s'\n", targets[i].protocol);
+    else
+      nconnected += 1;
+
+    if (errors)
+      errors[i] = e->error;
+  }
+
+  free(pending);
+  free(entries);
+  return nconnected;
+}
+
+int catui_connect(const char *proto, const char *semver, FILE *err) {
+  return catui_connect_ex(proto, semver, 0, NULL, err);
+}
+
+int catui_connect_mux(const char *proto, const char *semver, FILE *err) {
+  return catui_connect_ex(proto, semver, CATUI_CONNECT_MULTIPLEX, NULL, err);
+}
+
 typedef char semver_buf[CATUI_VERSION_SIZE];
 
 static int semver_encode(const catui_semver *v, char *buf) {
@@ -82,8 +410,8 @@ static int semver_decode(const char *str, catui_semver *v) {
   return catui_semver_from_string(str, strlen(str), v);
 }
 
-int catui_encode_connect(const catui_connect_request *req, void *buf,
-                         size_t bufsz, size_t *msgsz) {
+int catui_encode_connect_ex(const catui_connect_request *req, uint32_t flags,
+                            void *buf, size_t bufsz, size_t *msgsz) {
   cJSON *obj = cJSON_CreateObject();
   if (!obj)
     return 0;
@@ -117,6 +445,16 @@ int catui_encode_connect(const catui_connect_request *req, void *buf,
   if (!cJSON_AddItemToObject(obj, "version", jprotov))
     return 0;
 
+  if (flags & CATUI_CONNECT_MULTIPLEX) {
+    if (!cJSON_AddTrueToObject(obj, "multiplex"))
+      return 0;
+  }
+
+  if (flags & CATUI_CONNECT_ACK_INFO) {
+    if (!cJSON_AddTrueToObject(obj, "ack-info"))
+      return 0;
+  }
+
   if (!cJSON_PrintPreallocated(obj, buf, bufsz, 0))
     return 0;
 
@@ -126,12 +464,139 @@ int catui_encode_connect(const catui_connect_request *req, void *buf,
   return 1;
 }
 
-int CATUI_API catui_decode_connect(const void *buf, size_t msgsz,
-                                   catui_connect_request *req) {
-  cJSON *obj = cJSON_ParseWithLength(buf, msgsz);
-  if (!obj)
+int catui_encode_connect(const catui_connect_request *req, void *buf,
+                         size_t bufsz, size_t *msgsz) {
+  return catui_encode_connect_ex(req, 0, buf, bufsz, msgsz);
+}
+
+typedef struct {
+  const char *it;
+  const char *end;
+} scanner;
+
+static void skip_ws(scanner *s) {
+  while (s->it < s->end && isspace((unsigned char)*s->it))
+    ++s->it;
+}
+
+static int scan_char(scanner *s, char c) {
+  skip_ws(s);
+  if (s->it == s->end || *s->it != c)
+    return 0;
+
+  ++s->it;
+  return 1;
+}
+
+// Only strings without escapes are scanned. They are used in place.
+static int scan_string(scanner *s, const char **str, size_t *len) {
+  if (!scan_char(s, '"'))
+    return 0;
+
+  const char *start = s->it;
+  for (; s->it < s->end; ++s->it) {
+    unsigned char c = *s->it;
+    if (c == '"') {
+      *str = start;
+      *len = s->it - start;
+      ++s->it;
+      return 1;
+    } else if (c == '\\' || c < 0x20) {
+      return 0;
+    }
+  }
+
+  return 0;
+}
+
+static int scan_literal(scanner *s, const char *lit) {
+  size_t n = strlen(lit);
+  if ((size_t)(s->end - s->it) < n || memcmp(s->it, lit, n) != 0)
+    return 0;
+
+  s->it += n;
+  return 1;
+}
+
+static int key_is(const char *key, size_t len, const char *expected) {
+  return strlen(expected) == len && memcmp(key, expected, len) == 0;
+}
+
+// Decode a connect request without allocating. Handles the common encoding
+// of the request and returns 0 for anything else (escapes, unknown or
+// repeated keys), leaving the general JSON parser to decide.
+static int decode_connect_fast(const void *buf, size_t msgsz,
+                               catui_connect_request *req, uint32_t *flags) {
+  scanner s = {buf, (const char *)buf + msgsz};
+  int seen_catui_version = 0, seen_protocol = 0, seen_version = 0;
+  uint32_t seen_flags = 0;
+
+  *flags = 0;
+
+  if (!scan_char(&s, '{'))
+    return 0;
+
+  do {
+    const char *key, *val;
+    size_t keylen, vallen;
+    if (!scan_string(&s, &key, &keylen) || !scan_char(&s, ':'))
+      return 0;
+
+    uint32_t flag = 0;
+    if (key_is(key, keylen, "multiplex"))
+      flag = CATUI_CONNECT_MULTIPLEX;
+    else if (key_is(key, keylen, "ack-info"))
+      flag = CATUI_CONNECT_ACK_INFO;
+
+    if (flag) {
+      if (seen_flags & flag)
+        return 0;
+
+      seen_flags |= flag;
+      skip_ws(&s);
+      if (scan_literal(&s, "true"))
+        *flags |= flag;
+      else if (!scan_literal(&s, "false"))
+        return 0;
+
+      continue;
+    }
+
+    if (!scan_string(&s, &val, &vallen))
+      return 0;
+
+    if (key_is(key, keylen, "catui-version") && !seen_catui_version) {
+      seen_catui_version = 1;
+      if (!catui_semver_from_string(val, vallen, &req->catui_version))
+        return 0;
+    } else if (key_is(key, keylen, "protocol") && !seen_protocol) {
+      seen_protocol = 1;
+      if (vallen >= CATUI_PROTOCOL_SIZE)
+        return 0;
+
+      memcpy(req->protocol, val, vallen);
+      req->protocol[vallen] = '\0';
+    } else if (key_is(key, keylen, "version") && !seen_version) {
+      seen_version = 1;
+      if (!catui_semver_from_string(val, vallen, &req->version))
+        return 0;
+    } else {
+      return 0;
+    }
+  } while (scan_char(&s, ','));
+
+  if (!scan_char(&s, '}'))
+    return 0;
+
+  skip_ws(&s);
+  if (s.it != s.end)
     return 0;
 
+  return seen_catui_version && seen_protocol && seen_version;
+}
+
+static int decode_connect_json(const cJSON *obj, catui_connect_request *req,
+                               uint32_t *flags) {
   cJSON *jcatui_version = cJSON_GetObjectItem(obj, "catui-version");
   if (!jcatui_version)
     return 0;
@@ -166,9 +631,89 @@ int CATUI_API catui_decode_connect(const void *buf, size_t msgsz,
   if (!semver_decode(version, &req->version))
     return 0;
 
+  *flags = 0;
+  if (cJSON_IsTrue(cJSON_GetObjectItem(obj, "multiplex")))
+    *flags |= CATUI_CONNECT_MULTIPLEX;
+
+  if (cJSON_IsTrue(cJSON_GetObjectItem(obj, "ack-info")))
+    *flags |= CATUI_CONNECT_ACK_INFO;
+
+  return 1;
+}
+
+int catui_decode_connect_ex(const void *buf, size_t msgsz,
+                            catui_connect_request *req, uint32_t *flags) {
+  uint32_t ignored;
+  if (!flags)
+    flags = &ignored;
+
+  if (decode_connect_fast(buf, msgsz, req, flags))
+    return 1;
+
+  cJSON *obj = cJSON_ParseWithLength(buf, msgsz);
+  if (!obj)
+    return 0;
+
+  int ok = decode_connect_json(obj, req, flags);
+  cJSON_Delete(obj);
+  return ok;
+}
+
+int CATUI_API catui_decode_connect(const void *buf, size_t msgsz,
+                                   catui_connect_request *req) {
+  return catui_decode_connect_ex(buf, msgsz, req, NULL);
+}
+
+static int decode_ack_json(const cJSON *obj, catui_ack_info *info) {
+  if (cJSON_GetObjectItem(obj, "error"))
+    return 0;
+
+  if (cJSON_IsTrue(cJSON_GetObjectItem(obj, "multiplex")))
+    info->flags |= CATUI_CONNECT_MULTIPLEX;
+
+  cJSON *jversion = cJSON_GetObjectItem(obj, "version");
+  if (!jversion)
+    return 1;
+
+  const char *version = cJSON_GetStringValue(jversion);
+  if (!version)
+    return 0;
+
+  if (!semver_decode(version, &info->version))
+    return 0;
+
+  cJSON *jcaps = cJSON_GetObjectItem(obj, "capabilities");
+  if (jcaps) {
+    if (!cJSON_IsNumber(jcaps))
+      return 0;
+
+    double caps = cJSON_GetNumberValue(jcaps);
+    if (!(0 <= caps && caps <= 0xffffffffu) || caps != (uint32_t)caps)
+      return 0;
+
+    info->capabilities = (uint32_t)caps;
+  }
+
+  info->flags |= CATUI_CONNECT_ACK_INFO;
   return 1;
 }
 
+int catui_decode_ack(const void *buf, size_t msgsz, catui_ack_info *info) {
+  memset(info, 0, sizeof(catui_ack_info));
+
+  // zero length ack is a plain success
+  if (msgsz == 0)
+    return 1;
+
+  cJSON *obj = cJSON_ParseWithLength(buf, msgsz);
+  if (!obj)
+    return 0;
+
+  int ok = decode_ack_json(obj, info);
+  cJSON_Delete(obj);
+  return ok;
+}
+
 int catui_semver_can_support(const catui_semver *api,
                              const catui_semver *consumer) {
   return catui_semver_can_use(consumer, api);
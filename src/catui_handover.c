@@ -0,0 +1,148 @@
+/**
+ * Copyright 2025 Nicholas Gulachek
+ *
+ * Use of this source code is governed by an MIT-style
+ * license that can be found in the LICENSE file or at
+ * https://opensource.org/licenses/MIT.
+ */
+#include "catui.h"
+#include <msgstream.h>
+#include <unixsocket.h>
+
+#include <cjson/cJSON.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+int catui_handover_send(int chan, int listen_fd, const int *server_fds,
+                        size_t n, FILE *err) {
+  char buf[CATUI_HANDOVER_SIZE];
+
+  int len = snprintf(buf, sizeof(buf), "{\"servers\":%lu}", n);
+  if (len < 0 || len >= (int)sizeof(buf)) {
+    fprintf(err, "Failed to encode handover of %lu servers\n", n);
+    return -1;
+  }
+
+  if (msgstream_fd_send(chan, buf, sizeof(buf), len)) {
+    fprintf(err, "Failed to send handover header\n");
+    return -1;
+  }
+
+  if (unix_send_fd(chan, listen_fd) == -1) {
+    fprintf(err, "Failed to send listening socket\n");
+    return -1;
+  }
+
+  for (size_t i = 0; i < n; ++i) {
+    if (unix_send_fd(chan, server_fds[i]) == -1) {
+      fprintf(err, "Failed to send server channel %lu\n", i);
+      return -1;
+    }
+  }
+
+  // the new instance owns the descriptors only once it says so
+  size_t msgsz;
+  int ec = msgstream_fd_recv(chan, buf, sizeof(buf), &msgsz);
+  if (ec) {
+    fprintf(err, "Failed to receive handover ack: %s\n", msgstream_errstr(ec));
+    return -1;
+  }
+
+  if (msgsz != 0) {
+    fprintf(err, "Received a nack response to handover: %.*s\n", (int)msgsz,
+            buf);
+    return -1;
+  }
+
+  return 0;
+}
+
+static int decode_header(const char *buf, size_t msgsz, size_t *n) {
+  cJSON *obj = cJSON_ParseWithLength(buf, msgsz);
+  if (!obj)
+    return 0;
+
+  cJSON *jservers = cJSON_GetObjectItem(obj, "servers");
+  int ok = cJSON_IsNumber(jservers);
+  if (ok) {
+    double servers = cJSON_GetNumberValue(jservers);
+    ok = 0 <= servers && servers <= (double)SIZE_MAX &&
+         servers == (double)(size_t)servers;
+    if (ok)
+      *n = (size_t)servers;
+  }
+
+  cJSON_Delete(obj);
+  return ok;
+}
+
+// Any non-empty message is a nack, so the sender stops waiting for an ack
+static void send_nack(int chan, const char *reason) {
+  char buf[CATUI_HANDOVER_SIZE];
+  int len = snprintf(buf, sizeof(buf), "%s", reason);
+  if (len >= (int)sizeof(buf))
+    len = sizeof(buf) - 1;
+
+  msgstream_fd_send(chan, buf, sizeof(buf), len);
+}
+
+static void close_all(int *fds, size_t n) {
+  for (size_t i = 0; i < n; ++i)
+    close(fds[i]);
+}
+
+int catui_handover_recv(int chan, int *listen_fd, int *server_fds,
+                        size_t server_fds_size, size_t *n, FILE *err) {
+  char buf[CATUI_HANDOVER_SIZE];
+
+  size_t msgsz;
+  int ec = msgstream_fd_recv(chan, buf, sizeof(buf), &msgsz);
+  if (ec) {
+    fprintf(err, "Failed to receive handover header: %s\n",
+            msgstream_errstr(ec));
+    return -1;
+  }
+
+  size_t nservers;
+  if (!decode_header(buf, msgsz, &nservers)) {
+    fprintf(err, "Failed to decode handover header\n");
+    send_nack(chan, "Invalid handover header");
+    return -1;
+  }
+
+  // the sender keeps routing when it receives a nack
+  if (nservers > server_fds_size) {
+    fprintf(err, "Handover of %lu servers exceeds capacity of %lu\n",
+            nservers, server_fds_size);
+    send_nack(chan, "Too many servers");
+    return -1;
+  }
+
+  int lfd = unix_recv_fd(chan);
+  if (lfd == -1) {
+    fprintf(err, "Failed to receive listening socket\n");
+    return -1;
+  }
+
+  for (size_t i = 0; i < nservers; ++i) {
+    server_fds[i] = unix_recv_fd(chan);
+    if (server_fds[i] == -1) {
+      fprintf(err, "Failed to receive server channel %lu\n", i);
+      close_all(server_fds, i);
+      close(lfd);
+      return -1;
+    }
+  }
+
+  if (msgstream_fd_send(chan, buf, sizeof(buf), 0)) {
+    fprintf(err, "Failed to send handover ack\n");
+    close_all(server_fds, nservers);
+    close(lfd);
+    return -1;
+  }
+
+  *listen_fd = lfd;
+  *n = nservers;
+  return 0;
+}
@@ -0,0 +1,243 @@
+/**
+ * Copyright 2025 Nicholas Gulachek
+ *
+ * Use of this source code is governed by an MIT-style
+ * license that can be found in the LICENSE file or at
+ * https://opensource.org/licenses/MIT.
+ */
+#include "catui.h"
+#include <msgstream.h>
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+static void put_u32(uint8_t *p, uint32_t n) {
+  p[0] = (uint8_t)(n >> 24);
+  p[1] = (uint8_t)(n >> 16);
+  p[2] = (uint8_t)(n >> 8);
+  p[3] = (uint8_t)n;
+}
+
+static uint32_t get_u32(const uint8_t *p) {
+  return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+         ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
+
+static int is_frame_type(uint8_t type) {
+  return CATUI_MUX_OPEN <= type && type <= CATUI_MUX_CLOSE;
+}
+
+int catui_mux_encode_frame(const catui_mux_frame *f, void *buf,
+                           size_t bufsz) {
+  if (bufsz < CATUI_MUX_HEADER_SIZE || !is_frame_type(f->type))
+    return 0;
+
+  uint8_t *p = buf;
+  p[0] = f->type;
+  put_u32(p + 1, f->stream_id);
+  put_u32(p + 5, f->value);
+  return 1;
+}
+
+int catui_mux_decode_frame(const void *buf, size_t bufsz, catui_mux_frame *f) {
+  if (bufsz < CATUI_MUX_HEADER_SIZE)
+    return 0;
+
+  const uint8_t *p = buf;
+  if (!is_frame_type(p[0]))
+    return 0;
+
+  f->type = p[0];
+  f->stream_id = get_u32(p + 1);
+  f->value = get_u32(p + 5);
+  return 1;
+}
+
+int catui_mux_send_frame(int fd, const catui_mux_frame *f, const void *payload,
+                         size_t payload_size, FILE *err) {
+  uint8_t buf[CATUI_MUX_FRAME_SIZE];
+
+  if (payload_size > CATUI_MUX_PAYLOAD_SIZE) {
+    fprintf(err, "Frame payload of size %lu exceeds maximum of %d\n",
+            payload_size, CATUI_MUX_PAYLOAD_SIZE);
+    return -1;
+  }
+
+  if (!catui_mux_encode_frame(f, buf, sizeof(buf))) {
+    fprintf(err, "Failed to encode frame of type %d\n", f->type);
+    return -1;
+  }
+
+  if (payload_size)
+    memcpy(buf + CATUI_MUX_HEADER_SIZE, payload, payload_size);
+
+  size_t msgsz = CATUI_MUX_HEADER_SIZE + payload_size;
+  if (msgstream_fd_send(fd, buf, sizeof(buf), msgsz)) {
+    fprintf(err, "Failed to send frame for stream %u\n", f->stream_id);
+    return -1;
+  }
+
+  return 0;
+}
+
+int catui_mux_recv_frame(int fd, catui_mux_frame *f, void *payload,
+                         size_t payload_size, size_t *nread, FILE *err) {
+  uint8_t buf[CATUI_MUX_FRAME_SIZE];
+  size_t msgsz;
+
+  int ec = msgstream_fd_recv(fd, buf, sizeof(buf), &msgsz);
+  if (ec) {
+    fprintf(err, "Failed to receive frame: %s\n", msgstream_errstr(ec));
+    return -1;
+  }
+
+  if (!catui_mux_decode_frame(buf, msgsz, f)) {
+    fprintf(err, "Failed to decode frame header\n");
+    return -1;
+  }
+
+  size_t n = msgsz - CATUI_MUX_HEADER_SIZE;
+  if (n > payload_size) {
+    fprintf(err, "Frame payload of size %lu does not fit buffer of size %lu\n",
+            n, payload_size);
+    return -1;
+  }
+
+  if (f->type == CATUI_MUX_DATA && f->value != n) {
+    fprintf(err, "Data frame declares %u bytes but carries %lu\n", f->value,
+            n);
+    return -1;
+  }
+
+  if (n)
+    memcpy(payload, buf + CATUI_MUX_HEADER_SIZE, n);
+
+  *nread = n;
+  return 0;
+}
+
+int catui_mux_open(int fd, catui_mux_session *s, uint32_t stream_id,
+                   uint32_t window, FILE *err) {
+  s->stream_id = stream_id;
+  s->send_window = 0;
+  s->recv_window = window;
+  s->state = CATUI_MUX_SESSION_OPENING;
+
+  catui_mux_frame f = {CATUI_MUX_OPEN, stream_id, window};
+  return catui_mux_send_frame(fd, &f, NULL, 0, err);
+}
+
+int catui_mux_accept(int fd, catui_mux_session *s, const catui_mux_frame *open,
+                     uint32_t window, FILE *err) {
+  if (open->type != CATUI_MUX_OPEN) {
+    fprintf(err, "Cannot accept stream %u from frame of type %d\n",
+            open->stream_id, open->type);
+    return -1;
+  }
+
+  s->stream_id = open->stream_id;
+  s->send_window = open->value;
+  s->recv_window = window;
+  s->state = CATUI_MUX_SESSION_OPEN;
+
+  catui_mux_frame f = {CATUI_MUX_ACK, open->stream_id, window};
+  return catui_mux_send_frame(fd, &f, NULL, 0, err);
+}
+
+int catui_mux_reject(int fd, const catui_mux_frame *open, const char *reason,
+                     FILE *err) {
+  if (open->type != CATUI_MUX_OPEN) {
+    fprintf(err, "Cannot reject stream %u from frame of type %d\n",
+            open->stream_id, open->type);
+    return -1;
+  }
+
+  size_t n = reason ? strlen(reason) : 0;
+  if (n > CATUI_MUX_PAYLOAD_SIZE)
+    n = CATUI_MUX_PAYLOAD_SIZE;
+
+  catui_mux_frame f = {CATUI_MUX_NACK, open->stream_id, 0};
+  return catui_mux_send_frame(fd, &f, reason, n, err);
+}
+
+int catui_mux_send(int fd, catui_mux_session *s, const void *data, size_t size,
+                   FILE *err) {
+  if (size > s->send_window) {
+    fprintf(err, "Sending %lu bytes exceeds window of %u on stream %u\n", size,
+            s->send_window, s->stream_id);
+    return -1;
+  }
+
+  catui_mux_frame f = {CATUI_MUX_DATA, s->stream_id, (uint32_t)size};
+  if (catui_mux_send_frame(fd, &f, data, size, err))
+    return -1;
+
+  s->send_window -= (uint32_t)size;
+  return 0;
+}
+
+int catui_mux_grant(int fd, catui_mux_session *s, uint32_t size, FILE *err) {
+  if (size > UINT32_MAX - s->recv_window) {
+    fprintf(err, "Granting %u bytes overflows window on stream %u\n", size,
+            s->stream_id);
+    return -1;
+  }
+
+  catui_mux_frame f = {CATUI_MUX_WINDOW, s->stream_id, size};
+  if (catui_mux_send_frame(fd, &f, NULL, 0, err))
+    return -1;
+
+  s->recv_window += size;
+  return 0;
+}
+
+int catui_mux_close(int fd, const catui_mux_session *s, FILE *err) {
+  catui_mux_frame f = {CATUI_MUX_CLOSE, s->stream_id, 0};
+  return catui_mux_send_frame(fd, &f, NULL, 0, err);
+}
+
+int catui_mux_update(catui_mux_session *s, const catui_mux_frame *f) {
+  if (f->stream_id != s->stream_id)
+    return 0;
+
+  if (s->state == CATUI_MUX_SESSION_REJECTED ||
+      s->state == CATUI_MUX_SESSION_CLOSED)
+    return 0;
+
+  switch (f->type) {
+  case CATUI_MUX_ACK:
+    // a duplicate or late ack would reset the window already in use
+    if (s->state != CATUI_MUX_SESSION_OPENING)
+      return 0;
+
+    s->send_window = f->value;
+    s->state = CATUI_MUX_SESSION_OPEN;
+    return 1;
+  case CATUI_MUX_NACK:
+    if (s->state != CATUI_MUX_SESSION_OPENING)
+      return 0;
+
+    s->send_window = 0;
+    s->state = CATUI_MUX_SESSION_REJECTED;
+    return 1;
+  case CATUI_MUX_CLOSE:
+    s->send_window = 0;
+    s->state = CATUI_MUX_SESSION_CLOSED;
+    return 1;
+  case CATUI_MUX_WINDOW:
+    if (f->value > UINT32_MAX - s->send_window)
+      return 0;
+
+    s->send_window += f->value;
+    return 1;
+  case CATUI_MUX_DATA:
+    if (f->value > s->recv_window)
+      return 0;
+
+    s->recv_window -= f->value;
+    return 1;
+  default:
+    return 1;
+  }
+}
@@ -0,0 +1,436 @@
+/**
+ * Copyright 2025 Nicholas Gulachek
+ *
+ * Use of this source code is governed by an MIT-style
+ * license that can be found in the LICENSE file or at
+ * https://opensource.org/licenses/MIT.
+ */
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE // posix_spawn_file_actions_addclosefrom_np
+#endif
+
+#include "catui.h"
+#include <unixsocket.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <spawn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+extern char **environ;
+
+// the spawned server's end of its load balancer channel
+#define SERVER_FD 3
+#define SERVER_FD_ENV "CATUI_LOAD_BALANCER_FD=3"
+
+// how often the background thread checks on servers without being woken
+#define REPLENISH_INTERVAL_NS 100000000ll
+
+// the interval doubles with each failed round up to this many times (12.8 s)
+#define MAX_BACKOFF_SHIFT 7
+
+#ifdef SOCK_CLOEXEC
+#define CHANNEL_TYPE (SOCK_STREAM | SOCK_CLOEXEC)
+#else
+#define CHANNEL_TYPE SOCK_STREAM
+#endif
+
+#if defined(__GLIBC__) &&                                                      \
+    (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 34))
+#define HAVE_ADDCLOSEFROM 1
+#endif
+
+typedef struct {
+  pid_t pid;
+  int chan;
+} pool_server;
+
+struct catui_pool {
+  char *const *argv;
+  size_t size;
+  FILE *err;
+
+  pthread_mutex_t mtx;
+  pthread_cond_t cv;
+  pthread_t thread;
+  int stop;
+
+  // ready servers that have not been given a connection
+  pool_server *idle;
+  size_t nidle;
+
+  // servers that were given a connection and have not been reaped
+  pid_t *busy;
+  size_t nbusy;
+  size_t busy_cap;
+
+  // channels are created and spawned under this lock so no child inherits
+  // another child's channel, even where SOCK_CLOEXEC is unavailable
+  pthread_mutex_t spawn_mtx;
+};
+
+static int set_cloexec(int fd) {
+  int flags = fcntl(fd, F_GETFD);
+  if (flags == -1)
+    return -1;
+
+  return fcntl(fd, F_SETFD, flags | FD_CLOEXEC);
+}
+
+// environ with CATUI_LOAD_BALANCER_FD pointing at SERVER_FD
+static char **server_env() {
+  size_t n = 0;
+  while (environ[n])
+    ++n;
+
+  char **env = calloc(n + 2, sizeof(char *));
+  if (!env)
+    return NULL;
+
+  const char *name = "CATUI_LOAD_BALANCER_FD=";
+  size_t namelen = strlen(name);
+
+  size_t j = 0;
+  for (size_t i = 0; i < n; ++i) {
+    if (strncmp(environ[i], name, namelen) != 0)
+      env[j++] = environ[i];
+  }
+
+  env[j] = SERVER_FD_ENV;
+  return env;
+}
+
+// The caller's descriptors, like connections accepted by the load balancer,
+// may not be close-on-exec. Keep them out of servers so a client sees EOF when
+// its own server exits.
+static int inherit_only_server_fds(posix_spawn_file_actions_t *actions,
+                                   posix_spawnattr_t *attr) {
+#if defined(POSIX_SPAWN_CLOEXEC_DEFAULT)
+  for (int fd = 0; fd <= SERVER_FD; ++fd) {
+    if (posix_spawn_file_actions_addinherit_np(actions, fd))
+      return -1;
+  }
+
+  return posix_spawnattr_setflags(attr, POSIX_SPAWN_CLOEXEC_DEFAULT);
+#elif defined(HAVE_ADDCLOSEFROM)
+  (void)attr;
+  return posix_spawn_file_actions_addclosefrom_np(actions, SERVER_FD + 1);
+#else
+  (void)actions;
+  (void)attr;
+  return 0;
+#endif
+}
+
+static int spawn_server(catui_pool *p, pool_server *s, FILE *err) {
+  char **env = server_env();
+  if (!env) {
+    fprintf(err, "Failed to allocate server environment\n");
+    return -1;
+  }
+
+  int pair[2] = {-1, -1};
+  posix_spawn_file_actions_t actions;
+  posix_spawnattr_t attr;
+  int have_actions = 0, have_attr = 0;
+  int ret = -1;
+
+  pthread_mutex_lock(&p->spawn_mtx);
+
+  if (socketpair(AF_UNIX, CHANNEL_TYPE, 0, pair) == -1) {
+    fprintf(err, "Failed to allocate server channel: %s\n", strerror(errno));
+    goto unlock;
+  }
+
+  if (set_cloexec(pair[0]) == -1 || set_cloexec(pair[1]) == -1) {
+    fprintf(err, "Failed to prepare server channel\n");
+    goto unlock;
+  }
+
+  // dup2 to another descriptor clears FD_CLOEXEC in the child
+  if (pair[1] == SERVER_FD) {
+    int flags = fcntl(pair[1], F_GETFD);
+    fcntl(pair[1], F_SETFD, flags & ~FD_CLOEXEC);
+  }
+
+  if (posix_spawn_file_actions_init(&actions)) {
+    fprintf(err, "Failed to initialize spawn file actions\n");
+    goto unlock;
+  }
+
+  have_actions = 1;
+
+  if (posix_spawnattr_init(&attr)) {
+    fprintf(err, "Failed to initialize spawn attributes\n");
+    goto unlock;
+  }
+
+  have_attr = 1;
+
+  if (pair[1] != SERVER_FD &&
+      posix_spawn_file_actions_adddup2(&actions, pair[1], SERVER_FD)) {
+    fprintf(err, "Failed to map server channel to fd %d\n", SERVER_FD);
+    goto unlock;
+  }
+
+  if (inherit_only_server_fds(&actions, &attr)) {
+    fprintf(err, "Failed to limit descriptors inherited by server\n");
+    goto unlock;
+  }
+
+  int ec = posix_spawnp(&s->pid, p->argv[0], &actions, &attr, p->argv, env);
+  if (ec) {
+    fprintf(err, "Failed to spawn server '%s': %s\n", p->argv[0],
+            strerror(ec));
+    goto unlock;
+  }
+
+  s->chan = pair[0];
+  ret = 0;
+
+unlock:
+  if (have_attr)
+    posix_spawnattr_destroy(&attr);
+
+  if (have_actions)
+    posix_spawn_file_actions_destroy(&actions);
+
+  pthread_mutex_unlock(&p->spawn_mtx);
+
+  if (pair[1] != -1)
+    close(pair[1]);
+
+  if (ret == -1 && pair[0] != -1)
+    close(pair[0]);
+
+  free(env);
+  return ret;
+}
+
+static int exited(pid_t pid) { return waitpid(pid, NULL, WNOHANG) == pid; }
+
+// Drop exited servers, returning how many were idle. Called with mtx held
+static size_t reap(catui_pool *p) {
+  for (size_t i = 0; i < p->nbusy;) {
+    if (exited(p->busy[i]))
+      p->busy[i] = p->busy[--p->nbusy];
+    else
+      ++i;
+  }
+
+  // an idle server that died can never take a connection
+  size_t died = 0;
+  for (size_t i = 0; i < p->nidle;) {
+    if (exited(p->idle[i].pid)) {
+      close(p->idle[i].chan);
+      p->idle[i] = p->idle[--p->nidle];
+      ++died;
+    } else {
+      ++i;
+    }
+  }
+
+  return died;
+}
+
+// Called with mtx held. failures is the number of consecutive failed rounds
+static void wait_interval(catui_pool *p, unsigned failures) {
+  unsigned shift = failures < MAX_BACKOFF_SHIFT ? failures : MAX_BACKOFF_SHIFT;
+  long long ns = REPLENISH_INTERVAL_NS << shift;
+
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  ts.tv_sec += (time_t)(ns / 1000000000ll);
+  ts.tv_nsec += (long)(ns % 1000000000ll);
+  if (ts.tv_nsec >= 1000000000l) {
+    ts.tv_sec += 1;
+    ts.tv_nsec -= 1000000000l;
+  }
+
+  // while backing off, dispatches don't wake the thread to spawn again
+  do {
+    if (pthread_cond_timedwait(&p->cv, &p->mtx, &ts) == ETIMEDOUT)
+      return;
+  } while (failures && !p->stop);
+}
+
+static void *replenish_main(void *arg) {
+  catui_pool *p = arg;
+  unsigned failures = 0;
+
+  pthread_mutex_lock(&p->mtx);
+  while (!p->stop) {
+    // idle servers exiting on their own are as broken as failed spawns
+    int failed = reap(p) > 0;
+
+    size_t deficit = p->size - p->nidle;
+    pthread_mutex_unlock(&p->mtx);
+
+    for (size_t i = 0; i < deficit; ++i) {
+      pool_server s;
+      if (spawn_server(p, &s, p->err) == -1) {
+        failed = 1;
+        break;
+      }
+
+      pthread_mutex_lock(&p->mtx);
+      if (p->nidle < p->size && !p->stop) {
+        p->idle[p->nidle++] = s;
+        s.chan = -1;
+      }
+      pthread_mutex_unlock(&p->mtx);
+
+      // raced with destroy. The server exits when its channel closes
+      if (s.chan != -1) {
+        close(s.chan);
+        waitpid(s.pid, NULL, 0);
+      }
+    }
+
+    failures = failed ? failures + 1 : 0;
+
+    pthread_mutex_lock(&p->mtx);
+    if (!p->stop)
+      wait_interval(p, failures);
+  }
+  pthread_mutex_unlock(&p->mtx);
+
+  return NULL;
+}
+
+catui_pool *catui_pool_create(char *const *argv, size_t size, FILE *err) {
+  catui_pool *p = calloc(1, sizeof(catui_pool));
+  if (!p) {
+    fprintf(err, "Failed to allocate server pool\n");
+    return NULL;
+  }
+
+  p->argv = argv;
+  p->size = size;
+  p->err = err;
+  p->idle = calloc(size ? size : 1, sizeof(pool_server));
+  if (!p->idle) {
+    fprintf(err, "Failed to allocate %lu idle servers\n", size);
+    free(p);
+    return NULL;
+  }
+
+  pthread_mutex_init(&p->mtx, NULL);
+  pthread_mutex_init(&p->spawn_mtx, NULL);
+  pthread_cond_init(&p->cv, NULL);
+
+  // a bad command fails here instead of in the background thread
+  int spawned = size == 0 || spawn_server(p, &p->idle[0], err) == 0;
+  if (spawned && size > 0)
+    p->nidle = 1;
+
+  if (!spawned || pthread_create(&p->thread, NULL, replenish_main, p)) {
+    if (spawned)
+      fprintf(err, "Failed to start server pool thread\n");
+
+    for (size_t i = 0; i < p->nidle; ++i) {
+      close(p->idle[i].chan);
+      waitpid(p->idle[i].pid, NULL, 0);
+    }
+
+    pthread_cond_destroy(&p->cv);
+    pthread_mutex_destroy(&p->spawn_mtx);
+    pthread_mutex_destroy(&p->mtx);
+    free(p->idle);
+    free(p);
+    return NULL;
+  }
+
+  return p;
+}
+
+static int add_busy(catui_pool *p, pid_t pid) {
+  if (p->nbusy == p->busy_cap) {
+    size_t cap = p->busy_cap ? 2 * p->busy_cap : 16;
+    pid_t *busy = realloc(p->busy, cap * sizeof(pid_t));
+    if (!busy)
+      return -1;
+
+    p->busy = busy;
+    p->busy_cap = cap;
+  }
+
+  p->busy[p->nbusy++] = pid;
+  return 0;
+}
+
+int catui_pool_dispatch(catui_pool *p, int con, FILE *err) {
+  for (;;) {
+    pool_server s;
+    int cold = 0;
+
+    pthread_mutex_lock(&p->mtx);
+    if (p->nidle > 0) {
+      s = p->idle[--p->nidle];
+      pthread_cond_signal(&p->cv);
+    } else {
+      cold = 1;
+    }
+    pthread_mutex_unlock(&p->mtx);
+
+    if (cold && spawn_server(p, &s, err) == -1)
+      return -1;
+
+    int ret = unix_send_fd(s.chan, con);
+
+    // one connection per server. It sees the channel close on its next accept
+    close(s.chan);
+
+    pthread_mutex_lock(&p->mtx);
+    if (add_busy(p, s.pid) == -1)
+      fprintf(err, "Failed to track server %d. It will not be reaped\n",
+              (int)s.pid);
+    pthread_mutex_unlock(&p->mtx);
+
+    if (ret == 0)
+      return 0;
+
+    if (cold) {
+      fprintf(err, "Failed to send connection to server %d\n", (int)s.pid);
+      return -1;
+    }
+
+    // the idle server died since it was last reaped. Try another.
+  }
+}
+
+void catui_pool_destroy(catui_pool *p) {
+  if (!p)
+    return;
+
+  pthread_mutex_lock(&p->mtx);
+  p->stop = 1;
+  pthread_cond_signal(&p->cv);
+  pthread_mutex_unlock(&p->mtx);
+
+  pthread_join(p->thread, NULL);
+
+  // idle servers exit when their channel closes
+  for (size_t i = 0; i < p->nidle; ++i) {
+    close(p->idle[i].chan);
+    waitpid(p->idle[i].pid, NULL, 0);
+  }
+
+  // servers that were given a connection exit when it ends
+  for (size_t i = 0; i < p->nbusy; ++i)
+    waitpid(p->busy[i], NULL, 0);
+
+  pthread_cond_destroy(&p->cv);
+  pthread_mutex_destroy(&p->spawn_mtx);
+  pthread_mutex_destroy(&p->mtx);
+  free(p->busy);
+  free(p->idle);
+  free(p);
+}
@@ -0,0 +1,226 @@
+/**
+ * Copyright 2025 Nicholas Gulachek
+ *
+ * Use of this source code is governed by an MIT-style
+ * license that can be found in the LICENSE file or at
+ * https://opensource.org/licenses/MIT.
+ */
+#include "catui.h"
+#include <msgstream.h>
+
+#include <cjson/cJSON.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_SHARDS 16
+
+typedef struct {
+  uint64_t hash;
+  uint64_t generation;
+  size_t keylen;
+  int route;
+  char key[CATUI_ROUTE_KEY_SIZE];
+} route_entry;
+
+// Each shard is a direct mapped table guarded by its own lock so concurrent
+// lookups of different requests rarely contend
+typedef struct {
+  pthread_mutex_t mtx;
+  route_entry *entries;
+} route_shard;
+
+struct catui_route_cache {
+  // bumped to invalidate every entry at once. Entries start at generation 0,
+  // so the cache starts at 1.
+  _Atomic uint64_t generation;
+  size_t nshards;
+  size_t slots;
+  route_shard shards[MAX_SHARDS];
+};
+
+// FNV-1a
+static uint64_t hash_bytes(const void *buf, size_t n) {
+  const uint8_t *p = buf;
+  uint64_t h = 0xcbf29ce484222325llu;
+  for (size_t i = 0; i < n; ++i) {
+    h ^= p[i];
+    h *= 0x100000001b3llu;
+  }
+
+  return h;
+}
+
+catui_route_cache *catui_route_cache_create(size_t capacity) {
+  if (capacity == 0)
+    return NULL;
+
+  catui_route_cache *c = calloc(1, sizeof(catui_route_cache));
+  if (!c)
+    return NULL;
+
+  c->nshards = 1;
+  while (c->nshards * 2 <= MAX_SHARDS && c->nshards * 2 <= capacity)
+    c->nshards *= 2;
+
+  c->slots = (capacity + c->nshards - 1) / c->nshards;
+  atomic_init(&c->generation, 1);
+
+  for (size_t i = 0; i < c->nshards; ++i) {
+    route_shard *s = &c->shards[i];
+    s->entries = calloc(c->slots, sizeof(route_entry));
+    if (!s->entries || pthread_mutex_init(&s->mtx, NULL)) {
+      free(s->entries);
+      c->nshards = i;
+      catui_route_cache_destroy(c);
+      return NULL;
+    }
+  }
+
+  return c;
+}
+
+void catui_route_cache_destroy(catui_route_cache *c) {
+  if (!c)
+    return;
+
+  for (size_t i = 0; i < c->nshards; ++i) {
+    pthread_mutex_destroy(&c->shards[i].mtx);
+    free(c->shards[i].entries);
+  }
+
+  free(c);
+}
+
+static route_entry *find_slot(catui_route_cache *c, uint64_t hash,
+                              route_shard **shard) {
+  *shard = &c->shards[hash & (c->nshards - 1)];
+  return &(*shard)->entries[(hash >> 32) % c->slots];
+}
+
+int catui_route_cache_get(catui_route_cache *c, const void *req, size_t reqsz,
+                          int *route, uint64_t *generation) {
+  uint64_t gen = atomic_load(&c->generation);
+  if (generation)
+    *generation = gen;
+
+  if (reqsz > CATUI_ROUTE_KEY_SIZE)
+    return 0;
+
+  uint64_t hash = hash_bytes(req, reqsz);
+  route_shard *s;
+  route_entry *e = find_slot(c, hash, &s);
+
+  int hit = 0;
+  pthread_mutex_lock(&s->mtx);
+  if (e->generation == gen && e->hash == hash && e->keylen == reqsz &&
+      memcmp(e->key, req, reqsz) == 0) {
+    *route = e->route;
+    hit = 1;
+  }
+  pthread_mutex_unlock(&s->mtx);
+
+  return hit;
+}
+
+void catui_route_cache_put(catui_route_cache *c, const void *req, size_t reqsz,
+                           int route, uint64_t generation) {
+  // a decision made before the last invalidation may already be wrong
+  if (reqsz > CATUI_ROUTE_KEY_SIZE || generation != atomic_load(&c->generation))
+    return;
+
+  uint64_t hash = hash_bytes(req, reqsz);
+  route_shard *s;
+  route_entry *e = find_slot(c, hash, &s);
+
+  pthread_mutex_lock(&s->mtx);
+  e->hash = hash;
+  e->generation = generation;
+  e->keylen = reqsz;
+  e->route = route;
+  memcpy(e->key, req, reqsz);
+  pthread_mutex_unlock(&s->mtx);
+}
+
+void catui_route_cache_invalidate(catui_route_cache *c) {
+  atomic_fetch_add(&c->generation, 1);
+}
+
+static int decode_u32(const cJSON *obj, const char *name, uint32_t *n) {
+  cJSON *item = cJSON_GetObjectItem(obj, name);
+  if (!cJSON_IsNumber(item))
+    return 0;
+
+  double value = cJSON_GetNumberValue(item);
+  if (!(0 <= value && value <= 0xffffffffu) || value != (uint32_t)value)
+    return 0;
+
+  *n = (uint32_t)value;
+  return 1;
+}
+
+int catui_decode_load_report(const void *buf, size_t msgsz,
+                             catui_load_report *report) {
+  cJSON *obj = cJSON_ParseWithLength(buf, msgsz);
+  if (!obj)
+    return 0;
+
+  int ok = decode_u32(obj, "active-sessions", &report->active_sessions) &&
+           decode_u32(obj, "queue-depth", &report->queue_depth);
+
+  cJSON_Delete(obj);
+  return ok;
+}
+
+int catui_recv_load_report(int fd, catui_load_report *report, FILE *err) {
+  char buf[CATUI_LOAD_REPORT_SIZE];
+
+  size_t msgsz;
+  int ec = msgstream_fd_recv(fd, buf, sizeof(buf), &msgsz);
+  if (ec) {
+    fprintf(err, "Failed to receive load report: %s\n", msgstream_errstr(ec));
+    return -1;
+  }
+
+  if (!catui_decode_load_report(buf, msgsz, report)) {
+    fprintf(err, "Failed to decode load report\n");
+    return -1;
+  }
+
+  return 0;
+}
+
+static uint64_t load_of(const catui_load_report *report) {
+  return (uint64_t)report->active_sessions + report->queue_depth;
+}
+
+// xorshift32. Cheap and good enough to pick servers
+static uint32_t next_random(uint32_t *seed) {
+  uint32_t x = *seed ? *seed : 0x9e3779b9u;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  *seed = x;
+  return x;
+}
+
+int catui_route_least_loaded(const catui_load_report *reports, size_t n,
+                             uint32_t *seed) {
+  if (n == 0)
+    return -1;
+
+  if (n == 1)
+    return 0;
+
+  // power of two choices: nearly as good as the least loaded of all, without
+  // every load balancer herding onto the same server between reports
+  size_t a = next_random(seed) % n;
+  size_t b = next_random(seed) % (n - 1);
+  if (b >= a)
+    b += 1;
+
+  return load_of(&reports[b]) < load_of(&reports[a]) ? (int)b : (int)a;
+}
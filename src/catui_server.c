@@ -10,7 +10,6 @@
 
 #include <unixsocket.h>
 
-#include <cjson/cJSON.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -39,6 +38,7 @@ int catui_server_accept(int fd, FILE *err) {
     return -1;
   }
 
+  catui_trace(CATUI_TRACE_FD_ACCEPTED, con);
   return con;
 }
 
@@ -46,26 +46,87 @@ int16_t catui_server_encode_ack(void *buf, size_t buf_size, FILE *err) {
   return 0;
 }
 
-int16_t catui_server_encode_nack(void *buf, size_t buf_size,
-                                 const char *err_to_send, FILE *err) {
-  cJSON *obj = cJSON_CreateObject();
-  if (!obj) {
-    if (err)
-      fprintf(err, "Failed to create nack json object\n");
-    return -1;
-  }
+// Append str to buf as a JSON string. Returns 0 if it doesn't fit
+static int append_json_string(char *buf, size_t buf_size, size_t *pos,
+                              const char *str) {
+  static const char hex[] = "0123456789abcdef";
+  size_t i = *pos;
 
-  cJSON *err_str = cJSON_AddStringToObject(obj, "error", err_to_send);
-  if (!err_str) {
-    if (err)
-      fprintf(err,
-              "Failed to create json string for 'error' property on nack with "
-              "message '%s'\n",
-              err_to_send);
-    return -1;
+#define PUT(C)                                                                 \
+  do {                                                                         \
+    if (i + 1 >= buf_size)                                                     \
+      return 0;                                                                \
+    buf[i++] = (C);                                                            \
+  } while (0)
+
+  PUT('"');
+  for (const unsigned char *c = (const unsigned char *)str; *c; ++c) {
+    switch (*c) {
+    case '"':
+    case '\\':
+      PUT('\\');
+      PUT(*c);
+      break;
+    case '\b':
+      PUT('\\');
+      PUT('b');
+      break;
+    case '\f':
+      PUT('\\');
+      PUT('f');
+      break;
+    case '\n':
+      PUT('\\');
+      PUT('n');
+      break;
+    case '\r':
+      PUT('\\');
+      PUT('r');
+      break;
+    case '\t':
+      PUT('\\');
+      PUT('t');
+      break;
+    default:
+      if (*c < 0x20) {
+        PUT('\\');
+        PUT('u');
+        PUT('0');
+        PUT('0');
+        PUT(hex[*c >> 4]);
+        PUT(hex[*c & 0xf]);
+      } else {
+        PUT(*c);
+      }
+      break;
+    }
   }
+  PUT('"');
+
+#undef PUT
+
+  buf[i] = '\0';
+  *pos = i;
+  return 1;
+}
+
+static int append_str(char *buf, size_t buf_size, size_t *pos,
+                      const char *str) {
+  size_t n = strlen(str);
+  if (*pos + n >= buf_size)
+    return 0;
 
-  if (!cJSON_PrintPreallocated(obj, buf, buf_size, 0)) {
+  memcpy(buf + *pos, str, n + 1);
+  *pos += n;
+  return 1;
+}
+
+int16_t catui_server_encode_nack(void *buf, size_t buf_size,
+                                 const char *err_to_send, FILE *err) {
+  size_t n = 0;
+  if (!(append_str(buf, buf_size, &n, "{\"error\":") &&
+        append_json_string(buf, buf_size, &n, err_to_send) &&
+        append_str(buf, buf_size, &n, "}"))) {
     if (err)
       fprintf(
           err,
@@ -74,8 +135,7 @@ int16_t catui_server_encode_nack(void *buf, size_t buf_size,
     return -1;
   }
 
-  cJSON_Delete(obj);
-  return strlen(buf);
+  return n;
 }
 
 int16_t catui_server_ack(int fd, FILE *err) {
@@ -90,6 +150,7 @@ int16_t catui_server_ack(int fd, FILE *err) {
     return -1;
   }
 
+  catui_trace(CATUI_TRACE_ACK_SENT, fd);
   return 0;
 }
 
@@ -106,5 +167,166 @@ int16_t catui_server_nack(int fd, const char *err_to_send, FILE *err) {
     return -1;
   }
 
+  catui_trace(CATUI_TRACE_NACK_SENT, fd);
+  return 0;
+}
+
+int16_t catui_server_encode_ack_info(const catui_ack_info *info, void *buf,
+                                     size_t buf_size, FILE *err) {
+  // nothing to say beyond success. Stay compatible with every client
+  if (!(info->flags & (CATUI_CONNECT_MULTIPLEX | CATUI_CONNECT_ACK_INFO)))
+    return catui_server_encode_ack(buf, buf_size, err);
+
+  const char *multiplex =
+      (info->flags & CATUI_CONNECT_MULTIPLEX) ? "\"multiplex\":true" : "";
+
+  int n;
+  if (info->flags & CATUI_CONNECT_ACK_INFO) {
+    char version[CATUI_VERSION_SIZE];
+    int vn = catui_semver_to_string(&info->version, version, sizeof(version));
+    if (vn < 0 || vn >= (int)sizeof(version)) {
+      if (err)
+        fprintf(err, "Failed to serialize version for ack\n");
+      return -1;
+    }
+
+    n = snprintf(buf, buf_size, "{%s%s\"version\":\"%s\",\"capabilities\":%u}",
+                 multiplex, *multiplex ? "," : "", version, info->capabilities);
+  } else {
+    n = snprintf(buf, buf_size, "{%s}", multiplex);
+  }
+
+  if (n < 0 || (size_t)n >= buf_size) {
+    if (err)
+      fprintf(err, "Failed to encode ack in buffer of size '%lu'\n", buf_size);
+    return -1;
+  }
+
+  return n;
+}
+
+int16_t catui_server_ack_info(int fd, const catui_ack_info *info, FILE *err) {
+  char ack[CATUI_ACK_SIZE];
+  int16_t n = catui_server_encode_ack_info(info, ack, sizeof(ack), err);
+
+  if (n < 0)
+    return -1;
+
+  if (msgstream_fd_send(fd, ack, sizeof(ack), n)) {
+    fprintf(err, "Failed to send catui ack\n");
+    return -1;
+  }
+
+  catui_trace(CATUI_TRACE_ACK_SENT, fd);
+  return 0;
+}
+
+int16_t catui_server_encode_mux_ack(void *buf, size_t buf_size, FILE *err) {
+  catui_ack_info info = {0};
+  info.flags = CATUI_CONNECT_MULTIPLEX;
+  return catui_server_encode_ack_info(&info, buf, buf_size, err);
+}
+
+int16_t catui_server_ack_mux(int fd, FILE *err) {
+  catui_ack_info info = {0};
+  info.flags = CATUI_CONNECT_MULTIPLEX;
+  return catui_server_ack_info(fd, &info, err);
+}
+
+// the catui protocol version this implementation speaks
+static const catui_semver catui_version_ = {0, 1, 0};
+
+const catui_server_protocol *
+catui_server_handshake(int con, const catui_server_protocol *protocols,
+                       size_t n, catui_connect_request *req, uint32_t *flags,
+                       FILE *err) {
+  char buf[CATUI_CONNECT_SIZE];
+
+  catui_connect_request fallback_req;
+  if (!req)
+    req = &fallback_req;
+
+  uint32_t fallback_flags;
+  if (!flags)
+    flags = &fallback_flags;
+
+  size_t msgsz;
+  int ec = msgstream_fd_recv(con, buf, sizeof(buf), &msgsz);
+  if (ec) {
+    fprintf(err, "Failed to receive connect request: %s\n",
+            msgstream_errstr(ec));
+    return NULL;
+  }
+
+  if (!catui_decode_connect_ex(buf, msgsz, req, flags)) {
+    fprintf(err, "Failed to decode connect request\n");
+    catui_server_nack(con, "Invalid connect request", err);
+    return NULL;
+  }
+
+  if (!catui_semver_can_support(&catui_version_, &req->catui_version)) {
+    fprintf(err, "Unsupported catui version in connect request\n");
+    catui_server_nack(con, "Unsupported catui version", err);
+    return NULL;
+  }
+
+  const catui_server_protocol *match = NULL;
+  for (size_t i = 0; i < n; ++i) {
+    if (strcmp(protocols[i].protocol, req->protocol) == 0 &&
+        catui_semver_can_support(&protocols[i].version, &req->version)) {
+      match = &protocols[i];
+      break;
+    }
+  }
+
+  if (!match) {
+    fprintf(err, "No supported version of protocol '%s'\n", req->protocol);
+    catui_server_nack(con, "Unsupported protocol version", err);
+    return NULL;
+  }
+
+  // every server can advertise its version and capabilities
+  *flags &= match->flags | CATUI_CONNECT_ACK_INFO;
+
+  catui_ack_info info;
+  info.flags = *flags;
+  info.version = match->version;
+  info.capabilities = match->capabilities;
+
+  if (catui_server_ack_info(con, &info, err) < 0)
+    return NULL;
+
+  return match;
+}
+
+int16_t catui_server_encode_load_report(const catui_load_report *report,
+                                        void *buf, size_t buf_size,
+                                        FILE *err) {
+  int n = snprintf(buf, buf_size, "{\"active-sessions\":%u,\"queue-depth\":%u}",
+                   report->active_sessions, report->queue_depth);
+
+  if (n < 0 || (size_t)n >= buf_size) {
+    if (err)
+      fprintf(err, "Failed to encode load report in buffer of size '%lu'\n",
+              buf_size);
+    return -1;
+  }
+
+  return n;
+}
+
+int16_t catui_server_report_load(int fd, const catui_load_report *report,
+                                 FILE *err) {
+  char buf[CATUI_LOAD_REPORT_SIZE];
+  int16_t n = catui_server_encode_load_report(report, buf, sizeof(buf), err);
+
+  if (n < 0)
+    return -1;
+
+  if (msgstream_fd_send(fd, buf, sizeof(buf), n)) {
+    fprintf(err, "Failed to send load report\n");
+    return -1;
+  }
+
   return 0;
 }
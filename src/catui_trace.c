@@ -0,0 +1,220 @@
+/**
+ * Copyright 2025 Nicholas Gulachek
+ *
+ * Use of this source code is governed by an MIT-style
+ * license that can be found in the LICENSE file or at
+ * https://opensource.org/licenses/MIT.
+ */
+#include "catui.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DUMP_BATCH 64
+
+// Single producer ring owned by one thread. Rings are never freed so events
+// from exited threads can still be dumped.
+typedef struct trace_ring {
+  struct trace_ring *next;
+  uint32_t thread;
+  uint64_t mask;
+  // total number of events ever recorded
+  _Atomic uint64_t head;
+  catui_trace_event events[];
+} trace_ring;
+
+// capacity of new rings, 0 when disabled
+static _Atomic uint64_t capacity_;
+static _Atomic(trace_ring *) rings_;
+static _Atomic uint32_t nthreads_;
+static _Thread_local trace_ring *ring_;
+
+static char dump_path_[1024];
+
+static uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000llu + (uint64_t)ts.tv_nsec;
+}
+
+static trace_ring *make_ring(uint64_t capacity) {
+  trace_ring *r = malloc(sizeof(trace_ring) +
+                         (size_t)capacity * sizeof(catui_trace_event));
+  if (!r)
+    return NULL;
+
+  r->thread = atomic_fetch_add(&nthreads_, 1) + 1;
+  r->mask = capacity - 1;
+  atomic_init(&r->head, 0);
+
+  trace_ring *next = atomic_load(&rings_);
+  do {
+    r->next = next;
+  } while (!atomic_compare_exchange_weak(&rings_, &next, r));
+
+  return r;
+}
+
+int catui_trace_enable(size_t events_per_thread) {
+  if (events_per_thread == 0)
+    return 0;
+
+  uint64_t capacity = 1;
+  while (capacity < events_per_thread)
+    capacity <<= 1;
+
+  atomic_store(&capacity_, capacity);
+  return 1;
+}
+
+void catui_trace_disable(void) { atomic_store(&capacity_, 0); }
+
+void catui_trace(catui_trace_event_type type, int fd) {
+  uint64_t capacity = atomic_load_explicit(&capacity_, memory_order_relaxed);
+  if (!capacity)
+    return;
+
+  trace_ring *r = ring_;
+  if (!r) {
+    r = ring_ = make_ring(capacity);
+    if (!r)
+      return;
+  }
+
+  uint64_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+  catui_trace_event *e = &r->events[head & r->mask];
+  e->time_ns = now_ns();
+  e->thread = r->thread;
+  e->type = type;
+  e->fd = fd;
+
+  atomic_store_explicit(&r->head, head + 1, memory_order_release);
+}
+
+static int write_all(int fd, const void *buf, size_t n) {
+  const char *p = buf;
+  while (n > 0) {
+    ssize_t ret = write(fd, p, n);
+    if (ret == -1) {
+      if (errno == EINTR)
+        continue;
+
+      return -1;
+    }
+
+    p += ret;
+    n -= (size_t)ret;
+  }
+
+  return 0;
+}
+
+// Only async-signal-safe calls so this can run from a signal handler
+static int dump_rings(int fd) {
+  catui_trace_event batch[DUMP_BATCH];
+
+  uint32_t header[4] = {CATUI_TRACE_MAGIC, CATUI_TRACE_FORMAT_VERSION,
+                        sizeof(catui_trace_event), 0};
+  if (write_all(fd, header, sizeof(header)))
+    return -1;
+
+  for (trace_ring *r = atomic_load(&rings_); r; r = r->next) {
+    uint64_t capacity = r->mask + 1;
+    uint64_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+    uint64_t i = head > capacity ? head - capacity : 0;
+
+    while (i < head) {
+      uint64_t start = i;
+      size_t n = 0;
+      for (; i < head && n < DUMP_BATCH; ++i, ++n)
+        batch[n] = r->events[i & r->mask];
+
+      // the owner may have lapped us while copying. Drop what it overwrote,
+      // including the slot it may be writing now without having published it.
+      uint64_t now = atomic_load_explicit(&r->head, memory_order_acquire);
+      uint64_t oldest = now + 1 > capacity ? now + 1 - capacity : 0;
+      size_t skip = oldest > start ? (size_t)(oldest - start) : 0;
+      if (skip >= n)
+        continue;
+
+      if (write_all(fd, batch + skip, (n - skip) * sizeof(catui_trace_event)))
+        return -1;
+    }
+  }
+
+  return 0;
+}
+
+int catui_trace_dump(int fd, FILE *err) {
+  if (dump_rings(fd)) {
+    fprintf(err, "Failed to write trace dump: %s\n", strerror(errno));
+    return -1;
+  }
+
+  return 0;
+}
+
+static void dump_on_signal(int signum) {
+  int saved_errno = errno;
+
+  int fd = open(dump_path_, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd != -1) {
+    dump_rings(fd);
+    close(fd);
+  }
+
+  errno = saved_errno;
+}
+
+int catui_trace_dump_on_signal(int signum, const char *path, FILE *err) {
+  size_t n = strlen(path);
+  if (n >= sizeof(dump_path_)) {
+    fprintf(err, "Trace dump path '%s' is too long\n", path);
+    return -1;
+  }
+
+  memcpy(dump_path_, path, n + 1);
+
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = dump_on_signal;
+  sa.sa_flags = SA_RESTART;
+  sigemptyset(&sa.sa_mask);
+
+  if (sigaction(signum, &sa, NULL) == -1) {
+    fprintf(err, "Failed to install trace dump handler for signal %d: %s\n",
+            signum, strerror(errno));
+    return -1;
+  }
+
+  return 0;
+}
+
+const char *catui_trace_event_name(catui_trace_event_type type) {
+  switch (type) {
+  case CATUI_TRACE_CONNECT_START:
+    return "connect-start";
+  case CATUI_TRACE_REQUEST_SENT:
+    return "request-sent";
+  case CATUI_TRACE_ACK_RECEIVED:
+    return "ack-received";
+  case CATUI_TRACE_NACK_RECEIVED:
+    return "nack-received";
+  case CATUI_TRACE_FD_ACCEPTED:
+    return "fd-accepted";
+  case CATUI_TRACE_ACK_SENT:
+    return "ack-sent";
+  case CATUI_TRACE_NACK_SENT:
+    return "nack-sent";
+  default:
+    return "unknown";
+  }
+}
@@ -2,16 +2,26 @@
 
 #include <cjson/cJSON.h>
 #include <gtest/gtest.h>
+#include <msgstream.h>
+#include <unixsocket.h>
 
 #include <fcntl.h>
+#include <poll.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <array>
+#include <atomic>
 #include <string>
 #include <string_view>
+#include <thread>
+#include <vector>
 
 using std::size_t;
 using std::uint16_t;
@@ -60,6 +70,66 @@ struct catui_req {
   }
 };
 
+// The catui address is cached for the life of the process, so every test that
+// connects shares this listening socket
+int lb_listen_fd() {
+  static int fd = [] {
+    std::string addr;
+#ifdef __linux__
+    addr = "@catui_test." + std::to_string(::getpid());
+#else
+    addr = "/tmp/catui_test." + std::to_string(::getpid()) + ".sock";
+    ::unlink(addr.c_str());
+#endif
+    ::setenv("CATUI_ADDRESS", addr.c_str(), 1);
+
+    sockaddr_un un{};
+    un.sun_family = AF_UNIX;
+    socklen_t len = sizeof(un);
+    if (addr[0] == '@') {
+      ::memcpy(un.sun_path + 1, addr.data() + 1, addr.size() - 1);
+      len = offsetof(sockaddr_un, sun_path) + addr.size();
+    } else {
+      ::strcpy(un.sun_path, addr.c_str());
+    }
+
+    int sock = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    if (::bind(sock, reinterpret_cast<sockaddr *>(&un), len) == -1 ||
+        ::listen(sock, 16) == -1) {
+      ::perror("lb_listen_fd");
+      return -1;
+    }
+
+    return sock;
+  }();
+
+  return fd;
+}
+
+// Accept n connections on the test load balancer, calling respond with each
+// decoded request and its options
+template <typename Respond> std::thread serve(int n, Respond respond) {
+  int listen_fd = lb_listen_fd();
+
+  return std::thread{[listen_fd, n, respond] {
+    for (int i = 0; i < n; ++i) {
+      int con = ::accept(listen_fd, nullptr, nullptr);
+      if (con == -1)
+        return;
+
+      std::array<char, CATUI_CONNECT_SIZE> buf;
+      size_t msgsz;
+      catui_connect_request req{};
+      uint32_t flags;
+      if (msgstream_fd_recv(con, buf.data(), buf.size(), &msgsz) == 0 &&
+          catui_decode_connect_ex(buf.data(), msgsz, &req, &flags))
+        respond(con, req, flags);
+
+      ::close(con);
+    }
+  }};
+}
+
 class f : public testing::Test {
 protected:
   int write_;
@@ -150,6 +220,935 @@ TEST(Encoding, DecodedConnectFromRawJson) {
   EXPECT_EQ(req.version.patch, 7);
 }
 
+TEST(Encoding, MultiplexFlagRoundTrips) {
+  std::array<char, CATUI_CONNECT_SIZE> buf;
+
+  catui_connect_request req;
+  req.catui_version = {0, 1, 0};
+  strcpy(req.protocol, "com.example.test");
+  req.version = {1, 0, 0};
+
+  size_t msgsz;
+  ASSERT_TRUE(catui_encode_connect_ex(&req, CATUI_CONNECT_MULTIPLEX, buf.data(),
+                                      buf.size(), &msgsz));
+
+  catui_connect_request decoded;
+  uint32_t flags;
+  ASSERT_TRUE(catui_decode_connect_ex(buf.data(), msgsz, &decoded, &flags));
+  EXPECT_EQ(flags, CATUI_CONNECT_MULTIPLEX);
+
+  // decoders that don't know about options still accept the request
+  ASSERT_TRUE(catui_decode_connect(buf.data(), msgsz, &decoded));
+  EXPECT_EQ(std::string_view{decoded.protocol}, "com.example.test");
+}
+
+TEST(Encoding, EncodeConnectRequestsNoOptions) {
+  std::array<char, CATUI_CONNECT_SIZE> buf;
+
+  catui_connect_request req;
+  req.catui_version = {0, 1, 0};
+  strcpy(req.protocol, "com.example.test");
+  req.version = {1, 0, 0};
+
+  size_t msgsz;
+  ASSERT_TRUE(catui_encode_connect(&req, buf.data(), buf.size(), &msgsz));
+
+  catui_connect_request decoded;
+  uint32_t flags;
+  ASSERT_TRUE(catui_decode_connect_ex(buf.data(), msgsz, &decoded, &flags));
+  EXPECT_EQ(flags, 0);
+}
+
+TEST(Encoding, MuxAckIsJson) {
+  std::array<char, CATUI_ACK_SIZE> buf;
+
+  int16_t n = catui_server_encode_mux_ack(buf.data(), buf.size(), stderr);
+  ASSERT_GT(n, 0);
+
+  cJSON *json = cJSON_ParseWithLength(buf.data(), n);
+  ASSERT_TRUE(json);
+  EXPECT_TRUE(cJSON_IsTrue(cJSON_GetObjectItem(json, "multiplex")));
+  cJSON_Delete(json);
+}
+
+TEST(Encoding, ZeroLengthAckIsValid) {
+  catui_ack_info info;
+  info.flags = 0xff;
+
+  ASSERT_TRUE(catui_decode_ack("", 0, &info));
+  EXPECT_EQ(info.flags, 0);
+  EXPECT_EQ(info.capabilities, 0);
+}
+
+TEST(Encoding, NackIsNotAck) {
+  std::array<char, CATUI_ACK_SIZE> buf;
+  int16_t n = catui_server_encode_nack(buf.data(), buf.size(), "nope", nullptr);
+  ASSERT_GT(n, 0);
+
+  catui_ack_info info;
+  EXPECT_FALSE(catui_decode_ack(buf.data(), n, &info));
+}
+
+TEST(Encoding, NackEscapesMessage) {
+  std::array<char, CATUI_ACK_SIZE> buf;
+  const char *msg = "say \"no\"\\\n\x01";
+  int16_t n = catui_server_encode_nack(buf.data(), buf.size(), msg, nullptr);
+  ASSERT_GT(n, 0);
+
+  cJSON *json = cJSON_ParseWithLength(buf.data(), n);
+  ASSERT_TRUE(json);
+  EXPECT_EQ(json_str_prop(json, "error"), msg);
+  cJSON_Delete(json);
+}
+
+TEST(Encoding, NackTooLargeForBufFails) {
+  std::array<char, 16> buf;
+  EXPECT_LT(catui_server_encode_nack(buf.data(), buf.size(),
+                                     "a message that is too long", nullptr),
+            0);
+}
+
+TEST(Encoding, AckInfoRoundTrips) {
+  std::array<char, CATUI_ACK_SIZE> buf;
+
+  catui_ack_info info{};
+  info.flags = CATUI_CONNECT_ACK_INFO | CATUI_CONNECT_MULTIPLEX;
+  info.version = {3, 2, 1};
+  info.capabilities = 0xffffffffu;
+
+  int16_t n =
+      catui_server_encode_ack_info(&info, buf.data(), buf.size(), stderr);
+  ASSERT_GT(n, 0);
+
+  catui_ack_info decoded;
+  ASSERT_TRUE(catui_decode_ack(buf.data(), n, &decoded));
+  EXPECT_EQ(decoded.flags, info.flags);
+  EXPECT_EQ(decoded.version.major, 3);
+  EXPECT_EQ(decoded.version.minor, 2);
+  EXPECT_EQ(decoded.version.patch, 1);
+  EXPECT_EQ(decoded.capabilities, 0xffffffffu);
+}
+
+TEST(Encoding, AckInfoWithoutFlagsIsZeroLength) {
+  std::array<char, CATUI_ACK_SIZE> buf;
+
+  catui_ack_info info{};
+  info.version = {3, 2, 1};
+
+  EXPECT_EQ(
+      catui_server_encode_ack_info(&info, buf.data(), buf.size(), stderr), 0);
+}
+
+TEST(Mux, FrameRoundTrips) {
+  std::array<uint8_t, CATUI_MUX_HEADER_SIZE> buf;
+
+  catui_mux_frame f = {CATUI_MUX_WINDOW, 0x01020304, 0xfffffffe};
+  ASSERT_TRUE(catui_mux_encode_frame(&f, buf.data(), buf.size()));
+
+  catui_mux_frame decoded;
+  ASSERT_TRUE(catui_mux_decode_frame(buf.data(), buf.size(), &decoded));
+  EXPECT_EQ(decoded.type, CATUI_MUX_WINDOW);
+  EXPECT_EQ(decoded.stream_id, 0x01020304);
+  EXPECT_EQ(decoded.value, 0xfffffffe);
+}
+
+TEST(Mux, UnknownFrameTypeFailsToDecode) {
+  std::array<uint8_t, CATUI_MUX_HEADER_SIZE> buf{};
+  buf[0] = 0xff;
+
+  catui_mux_frame f;
+  EXPECT_FALSE(catui_mux_decode_frame(buf.data(), buf.size(), &f));
+}
+
+TEST(Mux, DataBeyondReceiveWindowIsViolation) {
+  catui_mux_session s = {7, 0, 10};
+
+  catui_mux_frame ok = {CATUI_MUX_DATA, 7, 10};
+  EXPECT_TRUE(catui_mux_update(&s, &ok));
+  EXPECT_EQ(s.recv_window, 0);
+
+  catui_mux_frame over = {CATUI_MUX_DATA, 7, 1};
+  EXPECT_FALSE(catui_mux_update(&s, &over));
+}
+
+TEST_F(f, MuxOpenIsAcceptedWithPeerWindow) {
+  catui_mux_session client;
+  ASSERT_EQ(catui_mux_open(write_, &client, 3, 100, stderr), 0);
+
+  catui_mux_frame open;
+  size_t n;
+  ASSERT_EQ(catui_mux_recv_frame(read_, &open, nullptr, 0, &n, stderr), 0);
+  EXPECT_EQ(open.type, CATUI_MUX_OPEN);
+  EXPECT_EQ(open.stream_id, 3);
+
+  catui_mux_session server;
+  ASSERT_EQ(catui_mux_accept(write_, &server, &open, 50, stderr), 0);
+  EXPECT_EQ(server.send_window, 100);
+
+  catui_mux_frame ack;
+  ASSERT_EQ(catui_mux_recv_frame(read_, &ack, nullptr, 0, &n, stderr), 0);
+  ASSERT_TRUE(catui_mux_update(&client, &ack));
+  EXPECT_EQ(client.send_window, 50);
+}
+
+TEST(Mux, AckAfterOpenIsViolation) {
+  catui_mux_session s = {7, 0, 10, CATUI_MUX_SESSION_OPENING};
+
+  catui_mux_frame ack = {CATUI_MUX_ACK, 7, 20};
+  EXPECT_TRUE(catui_mux_update(&s, &ack));
+
+  catui_mux_frame data = {CATUI_MUX_DATA, 7, 5};
+  ASSERT_TRUE(catui_mux_update(&s, &data));
+
+  catui_mux_frame late = {CATUI_MUX_ACK, 7, 20};
+  EXPECT_FALSE(catui_mux_update(&s, &late));
+  EXPECT_EQ(s.send_window, 20);
+}
+
+TEST(Mux, CloseEndsSession) {
+  catui_mux_session s = {7, 20, 10, CATUI_MUX_SESSION_OPEN};
+
+  catui_mux_frame close = {CATUI_MUX_CLOSE, 7, 0};
+  EXPECT_TRUE(catui_mux_update(&s, &close));
+  EXPECT_EQ(s.state, CATUI_MUX_SESSION_CLOSED);
+  EXPECT_EQ(s.send_window, 0);
+
+  catui_mux_frame data = {CATUI_MUX_DATA, 7, 1};
+  EXPECT_FALSE(catui_mux_update(&s, &data));
+}
+
+TEST_F(f, MuxRejectNacksOpen) {
+  catui_mux_session client;
+  ASSERT_EQ(catui_mux_open(write_, &client, 3, 100, stderr), 0);
+
+  catui_mux_frame open;
+  size_t n;
+  ASSERT_EQ(catui_mux_recv_frame(read_, &open, nullptr, 0, &n, stderr), 0);
+  ASSERT_EQ(catui_mux_reject(write_, &open, "busy", stderr), 0);
+
+  catui_mux_frame nack;
+  std::array<char, 16> reason;
+  ASSERT_EQ(catui_mux_recv_frame(read_, &nack, reason.data(), reason.size(),
+                                 &n, stderr),
+            0);
+  EXPECT_EQ(nack.type, CATUI_MUX_NACK);
+  EXPECT_EQ(std::string_view(reason.data(), n), "busy");
+
+  ASSERT_TRUE(catui_mux_update(&client, &nack));
+  EXPECT_EQ(client.state, CATUI_MUX_SESSION_REJECTED);
+
+  catui_mux_frame ack = {CATUI_MUX_ACK, 3, 50};
+  EXPECT_FALSE(catui_mux_update(&client, &ack));
+  EXPECT_EQ(client.send_window, 0);
+}
+
+TEST_F(f, MuxSendRespectsWindow) {
+  catui_mux_session s = {1, 5, 0};
+
+  EXPECT_EQ(catui_mux_send(write_, &s, "hello!", 6, stderr), -1);
+  ASSERT_EQ(catui_mux_send(write_, &s, "hello", 5, stderr), 0);
+  EXPECT_EQ(s.send_window, 0);
+
+  catui_mux_frame frame;
+  std::array<char, 16> buf;
+  size_t n;
+  ASSERT_EQ(
+      catui_mux_recv_frame(read_, &frame, buf.data(), buf.size(), &n, stderr),
+      0);
+  EXPECT_EQ(frame.type, CATUI_MUX_DATA);
+  EXPECT_EQ(std::string_view(buf.data(), n), "hello");
+}
+
+TEST(Connect, ConnectsToLoadBalancerAddress) {
+  std::string protocol;
+  auto lb = serve(1, [&protocol](int con, const catui_connect_request &req,
+                                 uint32_t flags) {
+    protocol = req.protocol;
+    catui_server_ack(con, stderr);
+  });
+
+  int fd = catui_connect("com.example.test", "1.2.3", stderr);
+  lb.join();
+
+  EXPECT_NE(fd, -1);
+  EXPECT_EQ(protocol, "com.example.test");
+  ::close(fd);
+}
+
+TEST(Connect, NackFails) {
+  auto lb = serve(1, [](int con, const catui_connect_request &req,
+                        uint32_t flags) {
+    catui_server_nack(con, "nope", stderr);
+  });
+
+  int fd = catui_connect("com.example.test", "1.2.3", stderr);
+  lb.join();
+
+  EXPECT_EQ(fd, -1);
+}
+
+TEST(Connect, ReadsAckInfo) {
+  auto lb = serve(1, [](int con, const catui_connect_request &req,
+                        uint32_t flags) {
+    catui_ack_info info{};
+    info.flags = flags;
+    info.version = {1, 2, 7};
+    info.capabilities = 0x10;
+    catui_server_ack_info(con, &info, stderr);
+  });
+
+  catui_ack_info info;
+  int fd = catui_connect_ex("com.example.test", "1.2.3",
+                            CATUI_CONNECT_ACK_INFO, &info, stderr);
+  lb.join();
+
+  ASSERT_NE(fd, -1);
+  EXPECT_EQ(info.flags, CATUI_CONNECT_ACK_INFO);
+  EXPECT_EQ(info.version.patch, 7);
+  EXPECT_EQ(info.capabilities, 0x10);
+  ::close(fd);
+}
+
+TEST(Connect, OldServerAckHasNoInfo) {
+  auto lb = serve(1, [](int con, const catui_connect_request &req,
+                        uint32_t flags) {
+    catui_server_ack(con, stderr);
+  });
+
+  catui_ack_info info;
+  int fd = catui_connect_ex("com.example.test", "1.2.3",
+                            CATUI_CONNECT_ACK_INFO, &info, stderr);
+  lb.join();
+
+  ASSERT_NE(fd, -1);
+  EXPECT_EQ(info.flags, 0);
+  ::close(fd);
+}
+
+TEST(Connect, ConnectsToManyTargets) {
+  auto lb = serve(3, [](int con, const catui_connect_request &req,
+                        uint32_t flags) {
+    if (std::string_view{req.protocol} == "com.example.bad")
+      catui_server_nack(con, "nope", stderr);
+    else
+      catui_server_ack(con, stderr);
+  });
+
+  catui_connect_target targets[] = {{"com.example.a", "1.0.0"},
+                                    {"com.example.bad", "1.0.0"},
+                                    {"com.example.b", "2.0.0"}};
+  int fds[3];
+  int errors[3];
+  size_t n = catui_connect_many(targets, 3, fds, errors, stderr);
+  lb.join();
+
+  EXPECT_EQ(n, 2);
+  EXPECT_NE(fds[0], -1);
+  EXPECT_EQ(fds[1], -1);
+  EXPECT_NE(fds[2], -1);
+  EXPECT_EQ(errors[0], CATUI_CONNECT_ERROR_NONE);
+  EXPECT_EQ(errors[1], CATUI_CONNECT_ERROR_NACK);
+  EXPECT_EQ(errors[2], CATUI_CONNECT_ERROR_NONE);
+  ::close(fds[0]);
+  ::close(fds[2]);
+}
+
+TEST(Connect, ConnectsToMoreTargetsThanBacklog) {
+  constexpr int n = 40;
+  auto lb = serve(n, [](int con, const catui_connect_request &req,
+                        uint32_t flags) { catui_server_ack(con, stderr); });
+
+  std::vector<catui_connect_target> targets(n, {"com.example.a", "1.0.0"});
+  int fds[n];
+  EXPECT_EQ(catui_connect_many(targets.data(), n, fds, nullptr, stderr), n);
+  lb.join();
+
+  for (int fd : fds) {
+    EXPECT_NE(fd, -1);
+    ::close(fd);
+  }
+}
+
+TEST(Connect, MuxRequiresMuxAck) {
+  auto lb = serve(1, [](int con, const catui_connect_request &req,
+                        uint32_t flags) {
+    EXPECT_EQ(flags, CATUI_CONNECT_MULTIPLEX);
+    catui_server_ack(con, stderr);
+  });
+
+  int fd = catui_connect_mux("com.example.test", "1.2.3", stderr);
+  lb.join();
+
+  EXPECT_EQ(fd, -1);
+}
+
+TEST(Connect, MuxConnectsWithMuxAck) {
+  auto lb = serve(1, [](int con, const catui_connect_request &req,
+                        uint32_t flags) {
+    catui_server_ack_mux(con, stderr);
+  });
+
+  int fd = catui_connect_mux("com.example.test", "1.2.3", stderr);
+  lb.join();
+
+  EXPECT_NE(fd, -1);
+  ::close(fd);
+}
+
+TEST(Encoding, DecodedConnectWithExtraFields) {
+  std::string msg = R"({"catui-version":"0.1.0","protocol":"com.example.test",)"
+                    R"("version":"1.0.0","extra":42})";
+
+  catui_connect_request req;
+  ASSERT_TRUE(catui_decode_connect(msg.data(), msg.size(), &req));
+  EXPECT_EQ(std::string_view{req.protocol}, "com.example.test");
+  EXPECT_EQ(req.version.major, 1);
+}
+
+TEST(Encoding, DecodeConnectMissingVersionFails) {
+  std::string msg =
+      R"({"catui-version":"0.1.0","protocol":"com.example.test"})";
+
+  catui_connect_request req;
+  EXPECT_FALSE(catui_decode_connect(msg.data(), msg.size(), &req));
+}
+
+class handshake : public testing::Test {
+protected:
+  int client_;
+  int server_;
+
+  void SetUp() override {
+    int fds[2];
+    if (::socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == -1) {
+      ADD_FAILURE() << "Failed to allocate socketpair";
+      ::perror("socketpair");
+      return;
+    }
+
+    client_ = fds[0];
+    server_ = fds[1];
+  }
+
+  void TearDown() override {
+    ::close(client_);
+    ::close(server_);
+  }
+
+  void send_request(const char *protocol, uint16_t major, uint16_t minor,
+                    uint32_t flags = 0) {
+    catui_connect_request req{};
+    req.catui_version.minor = 1;
+    strcpy(req.protocol, protocol);
+    req.version.major = major;
+    req.version.minor = minor;
+
+    std::array<char, CATUI_CONNECT_SIZE> buf;
+    size_t msgsz;
+    ASSERT_TRUE(catui_encode_connect_ex(&req, flags, buf.data(), buf.size(),
+                                        &msgsz));
+    ASSERT_EQ(msgstream_fd_send(client_, buf.data(), buf.size(), msgsz), 0);
+  }
+
+  std::string recv_response() {
+    std::array<char, CATUI_ACK_SIZE> buf;
+    size_t msgsz;
+    if (msgstream_fd_recv(client_, buf.data(), buf.size(), &msgsz)) {
+      ADD_FAILURE() << "Failed to receive response";
+      return "<error>";
+    }
+
+    return std::string{buf.data(), msgsz};
+  }
+};
+
+const catui_server_protocol test_protocols[] = {
+    {"com.example.test", {1, 4, 0}, 0, 0},
+    {"com.example.test", {2, 1, 0}, CATUI_CONNECT_MULTIPLEX, 0x5},
+    {"com.example.other", {2, 3, 0}, 0, 0},
+};
+
+TEST_F(handshake, MatchesFirstSupportingEntry) {
+  send_request("com.example.test", 2, 0);
+
+  catui_connect_request req;
+  uint32_t flags;
+  auto match =
+      catui_server_handshake(server_, test_protocols, 3, &req, &flags, stderr);
+
+  EXPECT_EQ(match, &test_protocols[1]);
+  EXPECT_EQ(std::string_view{req.protocol}, "com.example.test");
+  EXPECT_EQ(recv_response(), "");
+}
+
+TEST_F(handshake, NacksUnsupportedVersion) {
+  send_request("com.example.other", 2, 4);
+
+  auto match =
+      catui_server_handshake(server_, test_protocols, 3, nullptr, nullptr,
+                             stderr);
+
+  EXPECT_EQ(match, nullptr);
+  EXPECT_NE(recv_response(), "");
+}
+
+TEST_F(handshake, AcksMultiplexWhenEntrySupportsIt) {
+  send_request("com.example.test", 2, 1, CATUI_CONNECT_MULTIPLEX);
+
+  catui_connect_request req;
+  uint32_t flags;
+  auto match =
+      catui_server_handshake(server_, test_protocols, 3, &req, &flags, stderr);
+
+  EXPECT_EQ(match, &test_protocols[1]);
+  EXPECT_EQ(flags, CATUI_CONNECT_MULTIPLEX);
+  EXPECT_EQ(recv_response(), R"({"multiplex":true})");
+}
+
+TEST_F(handshake, AdvertisesVersionAndCapabilitiesWhenRequested) {
+  send_request("com.example.test", 2, 0, CATUI_CONNECT_ACK_INFO);
+
+  auto match =
+      catui_server_handshake(server_, test_protocols, 3, nullptr, nullptr,
+                             stderr);
+  EXPECT_EQ(match, &test_protocols[1]);
+
+  std::string ack = recv_response();
+  catui_ack_info info;
+  ASSERT_TRUE(catui_decode_ack(ack.data(), ack.size(), &info));
+  EXPECT_EQ(info.flags, CATUI_CONNECT_ACK_INFO);
+  EXPECT_EQ(info.version.major, 2);
+  EXPECT_EQ(info.version.minor, 1);
+  EXPECT_EQ(info.version.patch, 0);
+  EXPECT_EQ(info.capabilities, 0x5);
+}
+
+TEST_F(handshake, PlainAckWhenEntryCannotMultiplex) {
+  send_request("com.example.test", 1, 2, CATUI_CONNECT_MULTIPLEX);
+
+  catui_connect_request req;
+  uint32_t flags;
+  auto match =
+      catui_server_handshake(server_, test_protocols, 3, &req, &flags, stderr);
+
+  EXPECT_EQ(match, &test_protocols[0]);
+  EXPECT_EQ(flags, 0);
+  EXPECT_EQ(recv_response(), "");
+}
+
+std::vector<catui_trace_event> dump_trace() {
+  std::vector<catui_trace_event> events;
+
+  FILE *f = ::tmpfile();
+  if (!f || catui_trace_dump(::fileno(f), stderr)) {
+    ADD_FAILURE() << "Failed to dump trace";
+    return events;
+  }
+
+  ::rewind(f);
+
+  uint32_t header[4];
+  if (::fread(header, sizeof(header), 1, f) != 1 ||
+      header[0] != CATUI_TRACE_MAGIC) {
+    ADD_FAILURE() << "Trace dump is missing header";
+    return events;
+  }
+
+  catui_trace_event e;
+  while (::fread(&e, sizeof(e), 1, f) == 1)
+    events.push_back(e);
+
+  ::fclose(f);
+  return events;
+}
+
+TEST(Trace, RingKeepsMostRecentEvents) {
+  ASSERT_TRUE(catui_trace_enable(4));
+
+  uint32_t thread = 0;
+  std::thread th{[&thread] {
+    for (int i = 0; i < 10; ++i)
+      catui_trace(CATUI_TRACE_FD_ACCEPTED, 1000 + i);
+
+    thread = dump_trace().front().thread;
+  }};
+  th.join();
+
+  catui_trace_disable();
+
+  std::vector<int> fds;
+  for (const auto &e : dump_trace()) {
+    if (e.thread == thread)
+      fds.push_back(e.fd);
+  }
+
+  // the oldest slot of a wrapped ring is the next to be overwritten
+  EXPECT_EQ(fds, (std::vector<int>{1007, 1008, 1009}));
+}
+
+TEST(Trace, RecordsHandshakeEvents) {
+  ASSERT_TRUE(catui_trace_enable(64));
+
+  auto lb = serve(1, [](int con, const catui_connect_request &req,
+                        uint32_t flags) {
+    catui_server_ack(con, stderr);
+  });
+
+  int fd = catui_connect("com.example.test", "1.2.3", stderr);
+  lb.join();
+  catui_trace_disable();
+  ASSERT_NE(fd, -1);
+
+  auto events = dump_trace();
+  auto has = [&events](catui_trace_event_type type, int fd) {
+    return std::any_of(events.begin(), events.end(),
+                       [type, fd](const catui_trace_event &e) {
+                         return e.type == type && e.fd == fd;
+                       });
+  };
+
+  EXPECT_TRUE(has(CATUI_TRACE_CONNECT_START, fd));
+  EXPECT_TRUE(has(CATUI_TRACE_REQUEST_SENT, fd));
+  EXPECT_TRUE(has(CATUI_TRACE_ACK_RECEIVED, fd));
+  EXPECT_TRUE(std::any_of(events.begin(), events.end(),
+                          [](const catui_trace_event &e) {
+                            return e.type == CATUI_TRACE_ACK_SENT;
+                          }));
+  ::close(fd);
+}
+
+class route_cache : public testing::Test {
+protected:
+  catui_route_cache *cache_;
+
+  void SetUp() override { cache_ = catui_route_cache_create(8); }
+  void TearDown() override { catui_route_cache_destroy(cache_); }
+
+  void put(std::string_view req, int route) {
+    int ignore;
+    uint64_t gen;
+    catui_route_cache_get(cache_, req.data(), req.size(), &ignore, &gen);
+    catui_route_cache_put(cache_, req.data(), req.size(), route, gen);
+  }
+
+  bool get(std::string_view req, int *route) {
+    return catui_route_cache_get(cache_, req.data(), req.size(), route,
+                                 nullptr);
+  }
+};
+
+TEST_F(route_cache, HitsAfterPut) {
+  ASSERT_TRUE(cache_);
+  put("req-a", 3);
+
+  int route = -1;
+  EXPECT_TRUE(get("req-a", &route));
+  EXPECT_EQ(route, 3);
+  EXPECT_FALSE(get("req-b", &route));
+}
+
+TEST_F(route_cache, InvalidateDropsEntries) {
+  put("req-a", 3);
+  catui_route_cache_invalidate(cache_);
+
+  int route;
+  EXPECT_FALSE(get("req-a", &route));
+}
+
+TEST_F(route_cache, DecisionFromBeforeInvalidateIsNotCached) {
+  std::string_view req = "req-a";
+  int route;
+  uint64_t gen;
+  ASSERT_FALSE(
+      catui_route_cache_get(cache_, req.data(), req.size(), &route, &gen));
+
+  catui_route_cache_invalidate(cache_);
+  catui_route_cache_put(cache_, req.data(), req.size(), 3, gen);
+
+  EXPECT_FALSE(get(req, &route));
+}
+
+TEST_F(route_cache, StaysBounded) {
+  for (int i = 0; i < 100; ++i)
+    put("req-" + std::to_string(i), i);
+
+  int hits = 0;
+  for (int i = 0; i < 100; ++i) {
+    int route;
+    if (get("req-" + std::to_string(i), &route)) {
+      EXPECT_EQ(route, i);
+      hits += 1;
+    }
+  }
+
+  EXPECT_LE(hits, 8);
+}
+
+TEST(Load, ReportRoundTripsOverChannel) {
+  int fds[2];
+  ASSERT_NE(::socketpair(AF_UNIX, SOCK_STREAM, 0, fds), -1);
+
+  catui_load_report sent = {3, 7};
+  ASSERT_EQ(catui_server_report_load(fds[1], &sent, stderr), 0);
+
+  catui_load_report received;
+  ASSERT_EQ(catui_recv_load_report(fds[0], &received, stderr), 0);
+  EXPECT_EQ(received.active_sessions, 3);
+  EXPECT_EQ(received.queue_depth, 7);
+
+  ::close(fds[0]);
+  ::close(fds[1]);
+}
+
+TEST(Load, NegativeQueueDepthFailsToDecode) {
+  std::string_view msg = R"({"active-sessions":1,"queue-depth":-1})";
+  catui_load_report report;
+  EXPECT_FALSE(catui_decode_load_report(msg.data(), msg.size(), &report));
+}
+
+TEST(Load, LeastLoadedPicksLighterServer) {
+  // with two servers, power of two choices always compares both
+  catui_load_report reports[2] = {{4, 10}, {1, 2}};
+  uint32_t seed = 1;
+  for (int i = 0; i < 20; ++i)
+    EXPECT_EQ(catui_route_least_loaded(reports, 2, &seed), 1);
+
+  EXPECT_EQ(catui_route_least_loaded(reports, 1, &seed), 0);
+  EXPECT_EQ(catui_route_least_loaded(reports, 0, &seed), -1);
+}
+
+TEST(Load, LeastLoadedAvoidsHeaviestServer) {
+  catui_load_report reports[4] = {{0, 0}, {0, 0}, {0, 0}, {100, 0}};
+  uint32_t seed = 1;
+  for (int i = 0; i < 100; ++i)
+    EXPECT_NE(catui_route_least_loaded(reports, 4, &seed), 3);
+}
+
+// stands in for a server by draining its channel until the pool closes it
+char *const drain_server[] = {
+    (char *)"sh", (char *)"-c",
+    (char *)"cat <&$CATUI_LOAD_BALANCER_FD >/dev/null", nullptr};
+
+TEST(Pool, DispatchesToPrespawnedServers) {
+  catui_pool *pool = catui_pool_create(drain_server, 2, stderr);
+  ASSERT_TRUE(pool);
+
+  // more connections than idle servers
+  for (int i = 0; i < 3; ++i) {
+    int fds[2];
+    ASSERT_NE(::socketpair(AF_UNIX, SOCK_STREAM, 0, fds), -1);
+    EXPECT_EQ(catui_pool_dispatch(pool, fds[1], stderr), 0);
+    ::close(fds[0]);
+    ::close(fds[1]);
+  }
+
+  catui_pool_destroy(pool);
+}
+
+TEST(Pool, EmptyPoolSpawnsOnDispatch) {
+  catui_pool *pool = catui_pool_create(drain_server, 0, stderr);
+  ASSERT_TRUE(pool);
+
+  int fds[2];
+  ASSERT_NE(::socketpair(AF_UNIX, SOCK_STREAM, 0, fds), -1);
+  EXPECT_EQ(catui_pool_dispatch(pool, fds[1], stderr), 0);
+  ::close(fds[0]);
+  ::close(fds[1]);
+
+  catui_pool_destroy(pool);
+}
+
+TEST(Pool, BadCommandFailsCreate) {
+  char *const argv[] = {(char *)"catui-test-no-such-server", nullptr};
+  FILE *quiet = ::fopen("/dev/null", "w");
+
+  EXPECT_EQ(catui_pool_create(argv, 2, quiet), nullptr);
+  ::fclose(quiet);
+}
+
+TEST(Pool, ConcurrentDispatchLeaksNoDescriptors) {
+  catui_pool *pool = catui_pool_create(drain_server, 8, stderr);
+  ASSERT_TRUE(pool);
+
+  std::atomic<int> neof{0};
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 4; ++t) {
+    threads.emplace_back([pool, &neof] {
+      for (int i = 0; i < 8; ++i) {
+        int fds[2];
+        if (::socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == -1)
+          return;
+
+        catui_pool_dispatch(pool, fds[1], stderr);
+        ::close(fds[1]);
+
+        // the client only sees EOF if no other server inherited its
+        // connection
+        pollfd pfd = {fds[0], POLLIN, 0};
+        char c;
+        if (::poll(&pfd, 1, 5000) == 1 && ::read(fds[0], &c, 1) == 0)
+          neof += 1;
+
+        ::close(fds[0]);
+      }
+    });
+  }
+
+  for (auto &th : threads)
+    th.join();
+
+  EXPECT_EQ(neof, 32);
+
+  // hangs if a server holds another server's channel
+  catui_pool_destroy(pool);
+}
+
+// Forward connections on listen_fd to server until stop is set
+int run_test_lb(int listen_fd, int server, const std::atomic<bool> &stop) {
+  int handled = 0;
+  pollfd pfd = {listen_fd, POLLIN, 0};
+
+  while (!stop) {
+    if (::poll(&pfd, 1, 1) < 1)
+      continue;
+
+    int con = ::accept(listen_fd, nullptr, nullptr);
+    if (con == -1)
+      continue;
+
+    std::array<char, CATUI_CONNECT_SIZE> buf;
+    size_t msgsz;
+    if (msgstream_fd_recv(con, buf.data(), buf.size(), &msgsz) == 0 &&
+        unix_send_fd(server, con) == 0)
+      handled += 1;
+
+    ::close(con);
+  }
+
+  return handled;
+}
+
+TEST(Handover, NacksHandoverOverCapacity) {
+  int chan[2], fds[2];
+  ASSERT_NE(::socketpair(AF_UNIX, SOCK_STREAM, 0, chan), -1);
+  ASSERT_NE(::socketpair(AF_UNIX, SOCK_STREAM, 0, fds), -1);
+
+  FILE *quiet = ::fopen("/dev/null", "w");
+  int recv_ret = 0;
+  std::thread receiver{[&] {
+    int listen_fd, server_fd;
+    size_t n;
+    recv_ret =
+        catui_handover_recv(chan[1], &listen_fd, &server_fd, 1, &n, quiet);
+  }};
+
+  // fails from the nack while the receiving end is still open
+  EXPECT_EQ(catui_handover_send(chan[0], fds[0], fds, 2, quiet), -1);
+  receiver.join();
+  EXPECT_EQ(recv_ret, -1);
+
+  ::fclose(quiet);
+  for (int fd : {chan[0], chan[1], fds[0], fds[1]})
+    ::close(fd);
+}
+
+TEST(Handover, RestartUnderLoadDropsNoConnects) {
+  // sets CATUI_ADDRESS before any client resolves and caches it
+  ASSERT_NE(lb_listen_fd(), -1);
+
+  int server_chan[2], handover_chan[2];
+  ASSERT_NE(::socketpair(AF_UNIX, SOCK_STREAM, 0, server_chan), -1);
+  ASSERT_NE(::socketpair(AF_UNIX, SOCK_STREAM, 0, handover_chan), -1);
+
+  std::thread server{[fd = server_chan[1]] {
+    FILE *quiet = ::fopen("/dev/null", "w");
+    int con;
+    while ((con = catui_server_accept(fd, quiet)) != -1) {
+      catui_server_ack(con, stderr);
+      ::close(con);
+    }
+    ::fclose(quiet);
+  }};
+
+  std::atomic<bool> stop_old{false}, stop_new{false};
+  int handled_old = 0, handled_new = 0;
+
+  std::thread old_lb{[&] {
+    int listen_fd = ::dup(lb_listen_fd());
+    int lb_server = server_chan[0];
+    handled_old = run_test_lb(listen_fd, lb_server, stop_old);
+
+    EXPECT_EQ(catui_handover_send(handover_chan[0], listen_fd, &lb_server, 1,
+                                  stderr),
+              0);
+    ::close(listen_fd);
+    ::close(lb_server);
+  }};
+
+  std::atomic<bool> handover_failed{false};
+  std::thread new_lb{[&] {
+    int listen_fd, lb_server;
+    size_t n;
+    if (catui_handover_recv(handover_chan[1], &listen_fd, &lb_server, 1, &n,
+                            stderr)) {
+      // fail the remaining connects instead of leaving them to hang
+      handover_failed = true;
+      int fd = ::dup(lb_listen_fd());
+      run_test_lb(fd, -1, stop_new);
+      ::close(fd);
+      return;
+    }
+
+    EXPECT_EQ(n, 1);
+
+    handled_new = run_test_lb(listen_fd, lb_server, stop_new);
+    ::close(listen_fd);
+    ::close(lb_server);
+  }};
+
+  constexpr int nclients = 4, nconnects = 200;
+  std::atomic<int> nok{0}, nfailed{0};
+  std::vector<std::thread> clients;
+  for (int i = 0; i < nclients; ++i) {
+    clients.emplace_back([&] {
+      for (int j = 0; j < nconnects; ++j) {
+        int fd = catui_connect("com.example.test", "1.2.3", stderr);
+        if (fd == -1) {
+          nfailed += 1;
+        } else {
+          nok += 1;
+          ::close(fd);
+        }
+
+        // restart half way through
+        if (nok >= nclients * nconnects / 2)
+          stop_old = true;
+      }
+    });
+  }
+
+  for (auto &c : clients)
+    c.join();
+
+  stop_old = true;
+  old_lb.join();
+  stop_new = true;
+  new_lb.join();
+
+  // a failed handover leaves the server channel in flight on handover_chan
+  ::close(handover_chan[0]);
+  ::close(handover_chan[1]);
+  server.join();
+
+  ::close(server_chan[1]);
+
+  EXPECT_FALSE(handover_failed);
+  EXPECT_EQ(nfailed, 0);
+  EXPECT_EQ(nok, nclients * nconnects);
+  EXPECT_GT(handled_old, 0);
+  EXPECT_GT(handled_new, 0);
+}
+
 TEST(Semver, SameVersionOk) {
   MKSEMVER(v, 1, 2, 3);
 
@@ -0,0 +1,581 @@
+/**
+ * Copyright 2025 Nicholas Gulachek
+ *
+ * Use of this source code is governed by an MIT-style
+ * license that can be found in the LICENSE file or at
+ * https://opensource.org/licenses/MIT.
+ */
+#include "catui.h"
+#include <msgstream.h>
+#include <unixsocket.h>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_SERVERS 64
+#define TRACE_EVENTS_PER_THREAD 65536
+#define TRACE_OVERHEAD_CALLS 10000000
+
+static const char *usage =
+    "Usage: catui_loadgen [options]\n"
+    "\n"
+    "Runs client threads doing back-to-back or rate limited catui_connect\n"
+    "calls against CATUI_ADDRESS and reports throughput and latency.\n"
+    "\n"
+    "Options:\n"
+    "  -t <threads>   Number of client threads (default 4)\n"
+    "  -n <count>     Connects per client thread (default 1000)\n"
+    "  -r <rate>      Connects/sec per client thread, 0 for back-to-back\n"
+    "                 (default 0)\n"
+    "  -p <protocol>  Protocol to connect to (default com.example.loadgen)\n"
+    "  -v <semver>    Protocol version to connect to (default 1.0.0)\n"
+    "  -l             Run an in-process stand-in load balancer and set\n"
+    "                 CATUI_ADDRESS to it\n"
+    "  -s <servers>   Number of stand-in server threads with -l (default 1)\n"
+    "  -L             With -l, route to the least loaded server thread from\n"
+    "                 their load reports instead of round robin\n"
+    "  -D <us>        Extra time the first server thread takes to serve each\n"
+    "                 connection, simulating a slow server (default 0)\n"
+    "  -c <entries>   Routing decision cache size with -l, 0 to disable\n"
+    "                 (default 64)\n"
+    "  -P <idle>      With -l, hand each connection to its own server process\n"
+    "                 from a pool keeping <idle> prespawned servers ready.\n"
+    "                 0 spawns a server on each connect\n"
+    "  -W <ms>        Simulated startup time of server processes (default 0)\n"
+    "  -X             Run as a server process spawned by -P\n"
+    "  -T <path>      Trace handshake events and dump them to path at exit\n"
+    "                 or on SIGUSR1\n"
+    "  -h             Show this help\n";
+
+typedef struct {
+  const char *protocol;
+  const char *version;
+  int count;
+  int rate;
+  uint64_t *latencies;
+  int nfailed;
+} client_args;
+
+// routing decisions of the stand-in load balancer
+enum {
+  ROUTE_NACK_INVALID = -2,
+  ROUTE_NACK_INCOMPATIBLE = -1,
+  ROUTE_SERVER = 0
+};
+
+typedef struct {
+  int fd;
+  int delay_us;
+  int report;
+} server_args;
+
+typedef struct {
+  int listen_fd;
+  catui_route_cache *cache;
+  catui_pool *pool;
+  catui_semver version;
+  char protocol[CATUI_PROTOCOL_SIZE];
+  int servers[MAX_SERVERS];
+  int nservers;
+
+  // latest load reports, plus connections forwarded since each report
+  int least_loaded;
+  uint32_t seed;
+  pthread_mutex_t load_mtx;
+  catui_load_report loads[MAX_SERVERS];
+} balancer_args;
+
+static uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000llu + (uint64_t)ts.tv_nsec;
+}
+
+static void sleep_until(uint64_t t) {
+  uint64_t now = now_ns();
+  if (now >= t)
+    return;
+
+  uint64_t dt = t - now;
+  struct timespec ts = {(time_t)(dt / 1000000000llu),
+                        (long)(dt % 1000000000llu)};
+  nanosleep(&ts, NULL);
+}
+
+static void *client_main(void *arg) {
+  client_args *args = arg;
+  uint64_t interval = args->rate > 0 ? 1000000000llu / args->rate : 0;
+  uint64_t scheduled = now_ns();
+
+  for (int i = 0; i < args->count; ++i) {
+    // measure from the scheduled start so a slow handshake isn't hidden by
+    // the next one starting late
+    uint64_t start = scheduled;
+    if (interval) {
+      sleep_until(scheduled);
+      scheduled += interval;
+    } else {
+      start = now_ns();
+    }
+
+    int fd = catui_connect(args->protocol, args->version, stderr);
+    args->latencies[i] = now_ns() - start;
+
+    if (fd == -1)
+      args->nfailed += 1;
+    else
+      close(fd);
+  }
+
+  return NULL;
+}
+
+// Each forwarded connection that hasn't been accepted leaves a byte unread
+static uint32_t pending_connections(int fd) {
+  int n = 0;
+  if (ioctl(fd, FIONREAD, &n) == -1 || n < 0)
+    return 0;
+
+  return (uint32_t)n;
+}
+
+static void report_load(int fd, uint32_t active) {
+  catui_load_report report = {active, pending_connections(fd)};
+  catui_server_report_load(fd, &report, stderr);
+}
+
+static void *server_main(void *arg) {
+  server_args *args = arg;
+
+  for (;;) {
+    int con = catui_server_accept(args->fd, stderr);
+    if (con == -1)
+      return NULL;
+
+    if (args->report)
+      report_load(args->fd, 1);
+
+    if (args->delay_us)
+      sleep_until(now_ns() + (uint64_t)args->delay_us * 1000llu);
+
+    catui_server_ack(con, stderr);
+    close(con);
+
+    if (args->report)
+      report_load(args->fd, 0);
+  }
+}
+
+static void *reports_main(void *arg) {
+  balancer_args *args = arg;
+  struct pollfd pfds[MAX_SERVERS];
+
+  for (int i = 0; i < args->nservers; ++i) {
+    pfds[i].fd = args->servers[i];
+    pfds[i].events = POLLIN;
+  }
+
+  for (;;) {
+    if (poll(pfds, args->nservers, -1) == -1)
+      return NULL;
+
+    for (int i = 0; i < args->nservers; ++i) {
+      if (!pfds[i].revents)
+        continue;
+
+      catui_load_report report;
+      if (catui_recv_load_report(pfds[i].fd, &report, stderr) == -1)
+        return NULL;
+
+      pthread_mutex_lock(&args->load_mtx);
+      args->loads[i] = report;
+      pthread_mutex_unlock(&args->load_mtx);
+    }
+  }
+}
+
+static int pick_server(balancer_args *args, int *next) {
+  if (!args->least_loaded) {
+    int i = *next;
+    *next = (i + 1) % args->nservers;
+    return i;
+  }
+
+  pthread_mutex_lock(&args->load_mtx);
+  int i = catui_route_least_loaded(args->loads, args->nservers, &args->seed);
+  args->loads[i].queue_depth += 1;
+  pthread_mutex_unlock(&args->load_mtx);
+  return i;
+}
+
+static int route_request(balancer_args *args, const char *buf, size_t msgsz) {
+  catui_connect_request req;
+  if (!catui_decode_connect(buf, msgsz, &req))
+    return ROUTE_NACK_INVALID;
+
+  if (strcmp(req.protocol, args->protocol) != 0 ||
+      !catui_semver_can_support(&args->version, &req.version))
+    return ROUTE_NACK_INCOMPATIBLE;
+
+  return ROUTE_SERVER;
+}
+
+static void *balancer_main(void *arg) {
+  balancer_args *args = arg;
+  char buf[CATUI_CONNECT_SIZE];
+  int next = 0;
+
+  for (;;) {
+    int con = unix_accept(args->listen_fd);
+    if (con == -1)
+      return NULL;
+
+    size_t msgsz;
+    if (msgstream_fd_recv(con, buf, sizeof(buf), &msgsz)) {
+      catui_server_nack(con, "Invalid connect request", stderr);
+      close(con);
+      continue;
+    }
+
+    int route;
+    uint64_t gen;
+    if (!(args->cache &&
+          catui_route_cache_get(args->cache, buf, msgsz, &route, &gen))) {
+      route = route_request(args, buf, msgsz);
+      if (args->cache)
+        catui_route_cache_put(args->cache, buf, msgsz, route, gen);
+    }
+
+    if (route == ROUTE_NACK_INVALID) {
+      catui_server_nack(con, "Invalid connect request", stderr);
+    } else if (route == ROUTE_NACK_INCOMPATIBLE) {
+      catui_server_nack(con, "No compatible server", stderr);
+    } else if (args->pool) {
+      if (catui_pool_dispatch(args->pool, con, stderr) == -1)
+        catui_server_nack(con, "Failed to forward connection", stderr);
+    } else {
+      int server = args->servers[pick_server(args, &next)];
+      if (unix_send_fd(server, con) == -1)
+        catui_server_nack(con, "Failed to forward connection", stderr);
+    }
+
+    close(con);
+  }
+}
+
+// A server process spawned by the pool. Serves its one connection and exits
+static int serve_main(int startup_ms) {
+  sleep_until(now_ns() + (uint64_t)startup_ms * 1000000llu);
+
+  int fd = catui_server_fd(stderr);
+  if (fd == -1)
+    return 1;
+
+  // the pool closes the channel of idle servers on shutdown. Not an error.
+  FILE *quiet = fopen("/dev/null", "w");
+  int con = catui_server_accept(fd, quiet ? quiet : stderr);
+  if (quiet)
+    fclose(quiet);
+
+  if (con == -1)
+    return 0;
+
+  int ret = catui_server_ack(con, stderr);
+  close(con);
+  return ret < 0;
+}
+
+static int start_balancer(balancer_args *args, const char *proto,
+                          const char *semver, int nservers, int cache_size,
+                          catui_pool *pool, int least_loaded, int slow_us,
+                          char *addr, size_t addrsz) {
+  char dir[] = "/tmp/catui_loadgen.XXXXXX";
+  if (!mkdtemp(dir)) {
+    perror("mkdtemp");
+    return 0;
+  }
+
+  snprintf(addr, addrsz, "%s/load_balancer.sock", dir);
+
+  if (!catui_semver_from_string(semver, strlen(semver), &args->version)) {
+    fprintf(stderr, "Invalid version '%s'\n", semver);
+    return 0;
+  }
+
+  strlcpy(args->protocol, proto, sizeof(args->protocol));
+
+  args->pool = pool;
+  args->cache = NULL;
+  if (cache_size > 0) {
+    args->cache = catui_route_cache_create(cache_size);
+    if (!args->cache) {
+      fprintf(stderr, "Failed to create routing decision cache\n");
+      return 0;
+    }
+  }
+
+  args->listen_fd = unix_socket();
+  if (args->listen_fd == -1 || unix_bind(args->listen_fd, addr) == -1 ||
+      unix_listen(args->listen_fd, 128) == -1) {
+    fprintf(stderr, "Failed to listen on %s\n", addr);
+    return 0;
+  }
+
+  static server_args servers[MAX_SERVERS];
+
+  args->least_loaded = least_loaded;
+  args->seed = (uint32_t)now_ns();
+  memset(args->loads, 0, sizeof(args->loads));
+  pthread_mutex_init(&args->load_mtx, NULL);
+
+  args->nservers = nservers;
+  for (int i = 0; i < nservers; ++i) {
+    int pair[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair) == -1) {
+      perror("socketpair");
+      return 0;
+    }
+
+    args->servers[i] = pair[0];
+    servers[i].fd = pair[1];
+    servers[i].delay_us = i == 0 ? slow_us : 0;
+    servers[i].report = least_loaded;
+
+    pthread_t th;
+    if (pthread_create(&th, NULL, server_main, &servers[i])) {
+      fprintf(stderr, "Failed to start server thread\n");
+      return 0;
+    }
+
+    pthread_detach(th);
+  }
+
+  pthread_t th;
+  if (least_loaded) {
+    if (pthread_create(&th, NULL, reports_main, args)) {
+      fprintf(stderr, "Failed to start load report thread\n");
+      return 0;
+    }
+
+    pthread_detach(th);
+  }
+
+  if (pthread_create(&th, NULL, balancer_main, args)) {
+    fprintf(stderr, "Failed to start load balancer thread\n");
+    return 0;
+  }
+
+  pthread_detach(th);
+
+  if (setenv("CATUI_ADDRESS", addr, 1) == -1) {
+    perror("setenv");
+    return 0;
+  }
+
+  return 1;
+}
+
+// cost of a catui_trace call while tracing is disabled
+static double trace_disabled_ns() {
+  uint64_t start = now_ns();
+  for (int i = 0; i < TRACE_OVERHEAD_CALLS; ++i)
+    catui_trace(CATUI_TRACE_CONNECT_START, i);
+
+  return (double)(now_ns() - start) / TRACE_OVERHEAD_CALLS;
+}
+
+static int cmp_u64(const void *lhs, const void *rhs) {
+  uint64_t a = *(const uint64_t *)lhs, b = *(const uint64_t *)rhs;
+  return (a > b) - (a < b);
+}
+
+static double percentile_us(const uint64_t *sorted, size_t n, double p) {
+  size_t i = (size_t)(p * (double)(n - 1));
+  return (double)sorted[i] / 1000.0;
+}
+
+int main(int argc, char **argv) {
+  int nthreads = 4, count = 1000, rate = 0, nservers = 1, local = 0;
+  int cache_size = 64, pool_size = -1, startup_ms = 0, serve = 0;
+  int least_loaded = 0, slow_us = 0;
+  const char *proto = "com.example.loadgen";
+  const char *semver = "1.0.0";
+  const char *trace_path = NULL;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "t:n:r:p:v:ls:LD:c:P:W:XT:h")) != -1) {
+    switch (opt) {
+    case 't':
+      nthreads = atoi(optarg);
+      break;
+    case 'n':
+      count = atoi(optarg);
+      break;
+    case 'r':
+      rate = atoi(optarg);
+      break;
+    case 'p':
+      proto = optarg;
+      break;
+    case 'v':
+      semver = optarg;
+      break;
+    case 'l':
+      local = 1;
+      break;
+    case 's':
+      nservers = atoi(optarg);
+      break;
+    case 'L':
+      least_loaded = 1;
+      break;
+    case 'D':
+      slow_us = atoi(optarg);
+      break;
+    case 'c':
+      cache_size = atoi(optarg);
+      break;
+    case 'P':
+      pool_size = atoi(optarg);
+      break;
+    case 'W':
+      startup_ms = atoi(optarg);
+      break;
+    case 'X':
+      serve = 1;
+      break;
+    case 'T':
+      trace_path = optarg;
+      break;
+    case 'h':
+      fputs(usage, stdout);
+      return 0;
+    default:
+      fputs(usage, stderr);
+      return 1;
+    }
+  }
+
+  if (nthreads < 1 || count < 1 || rate < 0 || nservers < 1 ||
+      nservers > MAX_SERVERS || cache_size < 0 || startup_ms < 0 ||
+      slow_us < 0) {
+    fputs(usage, stderr);
+    return 1;
+  }
+
+  if (serve)
+    return serve_main(startup_ms);
+
+  double trace_ns = trace_disabled_ns();
+
+  if (trace_path) {
+    catui_trace_enable(TRACE_EVENTS_PER_THREAD);
+    if (catui_trace_dump_on_signal(SIGUSR1, trace_path, stderr))
+      return 1;
+  }
+
+  catui_pool *pool = NULL;
+  char startup_arg[16];
+  snprintf(startup_arg, sizeof(startup_arg), "%d", startup_ms);
+  char *server_argv[] = {argv[0], "-X", "-W", startup_arg, NULL};
+
+  if (local && pool_size >= 0) {
+    signal(SIGPIPE, SIG_IGN);
+
+    pool = catui_pool_create(server_argv, pool_size, stderr);
+    if (!pool)
+      return 1;
+
+    // give prespawned servers the time to start that a long running load
+    // balancer would have had. Applied to cold spawns too for comparison.
+    sleep_until(now_ns() + (uint64_t)(startup_ms + 100) * 1000000llu);
+  }
+
+  balancer_args balancer;
+  char addr[256];
+  if (local && !start_balancer(&balancer, proto, semver, nservers, cache_size,
+                               pool, least_loaded, slow_us, addr,
+                               sizeof(addr)))
+    return 1;
+
+  size_t total = (size_t)nthreads * (size_t)count;
+  uint64_t *latencies = calloc(total, sizeof(uint64_t));
+  client_args *clients = calloc(nthreads, sizeof(client_args));
+  pthread_t *threads = calloc(nthreads, sizeof(pthread_t));
+  if (!(latencies && clients && threads)) {
+    fprintf(stderr, "Failed to allocate memory for %d threads\n", nthreads);
+    return 1;
+  }
+
+  uint64_t start = now_ns();
+
+  for (int i = 0; i < nthreads; ++i) {
+    client_args *c = &clients[i];
+    c->protocol = proto;
+    c->version = semver;
+    c->count = count;
+    c->rate = rate;
+    c->latencies = latencies + (size_t)i * (size_t)count;
+
+    if (pthread_create(&threads[i], NULL, client_main, c)) {
+      fprintf(stderr, "Failed to start client thread\n");
+      return 1;
+    }
+  }
+
+  int nfailed = 0;
+  double first_us = 0.0;
+  for (int i = 0; i < nthreads; ++i) {
+    pthread_join(threads[i], NULL);
+    nfailed += clients[i].nfailed;
+    first_us += (double)clients[i].latencies[0] / 1000.0;
+  }
+
+  double elapsed = (double)(now_ns() - start) / 1e9;
+
+  qsort(latencies, total, sizeof(uint64_t), cmp_u64);
+
+  printf("connects: %lu ok, %d failed in %.3f s\n", total - nfailed, nfailed,
+         elapsed);
+  printf("connects/sec: %.1f\n", (double)total / elapsed);
+  printf("latency p50: %.1f us, p99: %.1f us, p999: %.1f us\n",
+         percentile_us(latencies, total, 0.50),
+         percentile_us(latencies, total, 0.99),
+         percentile_us(latencies, total, 0.999));
+  printf("first connect latency: %.1f us mean over threads\n",
+         first_us / nthreads);
+  printf("trace overhead when disabled: %.2f ns/event\n", trace_ns);
+
+  if (trace_path) {
+    int fd = open(trace_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1 || catui_trace_dump(fd, stderr)) {
+      fprintf(stderr, "Failed to dump trace to %s\n", trace_path);
+      nfailed += 1;
+    }
+
+    if (fd != -1)
+      close(fd);
+  }
+
+  if (local) {
+    unlink(addr);
+    *strrchr(addr, '/') = '\0';
+    rmdir(addr);
+  }
+
+  catui_pool_destroy(pool);
+  free(threads);
+  free(clients);
+  free(latencies);
+  return nfailed ? 1 : 0;
+}
@@ -0,0 +1,95 @@
+/**
+ * Copyright 2025 Nicholas Gulachek
+ *
+ * Use of this source code is governed by an MIT-style
+ * license that can be found in the LICENSE file or at
+ * https://opensource.org/licenses/MIT.
+ */
+#include "catui.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const char *usage =
+    "Usage: catui_trace_timeline [dump]\n"
+    "\n"
+    "Prints the events of a catui trace dump as a timeline ordered by time.\n"
+    "Reads the dump from stdin when no file is given.\n";
+
+static int cmp_event(const void *lhs, const void *rhs) {
+  const catui_trace_event *a = lhs, *b = rhs;
+  if (a->time_ns != b->time_ns)
+    return (a->time_ns > b->time_ns) - (a->time_ns < b->time_ns);
+
+  return (a->thread > b->thread) - (a->thread < b->thread);
+}
+
+int main(int argc, char **argv) {
+  if (argc > 2 || (argc == 2 && strcmp(argv[1], "-h") == 0)) {
+    fputs(usage, argc > 2 ? stderr : stdout);
+    return argc > 2;
+  }
+
+  FILE *f = stdin;
+  if (argc == 2) {
+    f = fopen(argv[1], "rb");
+    if (!f) {
+      perror(argv[1]);
+      return 1;
+    }
+  }
+
+  uint32_t header[4];
+  if (fread(header, sizeof(header), 1, f) != 1 ||
+      header[0] != CATUI_TRACE_MAGIC) {
+    fprintf(stderr, "Input is not a catui trace dump\n");
+    return 1;
+  }
+
+  if (header[1] != CATUI_TRACE_FORMAT_VERSION ||
+      header[2] != sizeof(catui_trace_event)) {
+    fprintf(stderr, "Unsupported trace dump format %u with event size %u\n",
+            header[1], header[2]);
+    return 1;
+  }
+
+  size_t n = 0, cap = 1024;
+  catui_trace_event *events = malloc(cap * sizeof(catui_trace_event));
+  if (!events) {
+    fprintf(stderr, "Failed to allocate memory for events\n");
+    return 1;
+  }
+
+  while (fread(&events[n], sizeof(catui_trace_event), 1, f) == 1) {
+    if (++n == cap) {
+      cap *= 2;
+      catui_trace_event *grown =
+          realloc(events, cap * sizeof(catui_trace_event));
+      if (!grown) {
+        fprintf(stderr, "Failed to allocate memory for %lu events\n", cap);
+        return 1;
+      }
+
+      events = grown;
+    }
+  }
+
+  if (f != stdin)
+    fclose(f);
+
+  qsort(events, n, sizeof(catui_trace_event), cmp_event);
+
+  printf("%12s %8s %8s  %s\n", "time_us", "thread", "fd", "event");
+
+  for (size_t i = 0; i < n; ++i) {
+    const catui_trace_event *e = &events[i];
+    double t = (double)(e->time_ns - events[0].time_ns) / 1000.0;
+    printf("%12.3f %8u %8d  %s\n", t, e->thread, e->fd,
+           catui_trace_event_name(e->type));
+  }
+
+  free(events);
+  return 0;
+}